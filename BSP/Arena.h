@@ -0,0 +1,186 @@
+#ifndef ARENA
+#define ARENA
+
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <new>
+using namespace std;
+
+const uint32_t NULL_INDEX = 0xFFFFFFFF;
+
+// Growable storage addressed by 32-bit indices.
+// Elements live in fixed-size chunks that never move, so indices and references stay valid while other threads allocate.
+// An arena can also view an array it does not own, such as a mapped file; it copies the array into its own chunks before it grows.
+template <typename T>
+class Arena
+{
+    public:
+        static const uint32_t CHUNK_BITS = 14;
+        static const uint32_t CHUNK_SIZE = 1 << CHUNK_BITS;
+        static const uint32_t MAX_CHUNKS = 1 << 14; // Up to 2^28 elements
+
+        Arena()
+        : count(0), chunks(new atomic<T *>[MAX_CHUNKS]())
+        {}
+
+        ~Arena()
+        {
+            clear();
+            delete[] chunks;
+        }
+
+        Arena(const Arena &) = delete;
+        Arena &operator=(const Arena &) = delete;
+
+        uint32_t allocate(uint32_t n = 1) // Thread-safe; returns the first of n consecutive indices, or throws bad_alloc past 2^28 elements
+        {
+            uint32_t first = count.load();
+            do
+            {
+                reserve(first, n); // Before the elements are counted, so that a failure leaves the count as it was
+            } while (!count.compare_exchange_weak(first, first + n));
+            return first;
+        }
+
+        uint32_t push(const T &element)
+        {
+            uint32_t index = allocate();
+            (*this)[index] = element;
+            return index;
+        }
+
+        void reserve(uint32_t capacity) // Make sure the chunks holding [0, capacity) exist
+        {
+            if (capacity > 0)
+            {
+                ensureChunks(0, (capacity - 1) >> CHUNK_BITS);
+            }
+        }
+
+        void reserve(uint32_t first, uint32_t n) // Same for [first, first + n); lets columns share the count of another arena
+        {
+            if (n > 0)
+            {
+                ensureChunks(first >> CHUNK_BITS, (uint32_t) (((uint64_t) first + n - 1) >> CHUNK_BITS));
+            }
+        }
+
+        void truncate(uint32_t n) // Not thread-safe; drops the elements from n on but keeps their chunks
+        {
+            if (n < count)
+            {
+                count = n;
+            }
+        }
+
+        void clear() // Not thread-safe; releases every chunk
+        {
+            for (uint32_t c = 0; c < MAX_CHUNKS; ++c)
+            {
+                T *chunk = chunks[c].exchange(nullptr);
+                if (c >= viewedChunks)
+                {
+                    delete[] chunk;
+                }
+            }
+            count = 0;
+            viewedChunks = 0;
+            viewedCount = 0;
+        }
+
+        void view(const T *data, uint32_t n) // Not thread-safe; releases every chunk and reads the n elements at data in place
+        {
+            clear();
+            for (uint32_t c = 0; c * CHUNK_SIZE < n; ++c)
+            {
+                chunks[c].store(const_cast<T *>(data) + c * CHUNK_SIZE, memory_order_relaxed); // Never written through while viewed
+                viewedChunks = c + 1;
+            }
+            count = n;
+            viewedCount = n;
+        }
+
+        void own() // Not thread-safe; copies the viewed elements below size() into chunks of the arena, after which the array may go away
+        {
+            uint32_t n = min(count.load(), viewedCount); // Never more than the viewed array holds
+            for (uint32_t c = 0; c < viewedChunks; ++c)
+            {
+                const T *source = chunks[c].load(memory_order_relaxed);
+                T *chunk = new T[CHUNK_SIZE]();
+                if (c * CHUNK_SIZE < n)
+                {
+                    copy(source, source + min(CHUNK_SIZE, n - c * CHUNK_SIZE), chunk);
+                }
+                chunks[c].store(chunk, memory_order_release);
+            }
+            viewedChunks = 0;
+            viewedCount = 0;
+        }
+
+        bool isViewing() const
+        {
+            return viewedChunks > 0;
+        }
+
+        template <typename F>
+        void forEachSpan(uint32_t first, uint32_t n, F visit) const // Calls visit(pointer, length) for the contiguous runs of [first, first + n)
+        {
+            while (n > 0)
+            {
+                uint32_t offset = first & (CHUNK_SIZE - 1);
+                uint32_t length = min(n, CHUNK_SIZE - offset);
+                visit(&(*this)[first], length);
+                first += length;
+                n -= length;
+            }
+        }
+
+        uint32_t size() const
+        {
+            return count.load();
+        }
+
+        T &operator[](uint32_t i)
+        {
+            return chunks[i >> CHUNK_BITS].load(memory_order_acquire)[i & (CHUNK_SIZE - 1)];
+        }
+
+        const T &operator[](uint32_t i) const
+        {
+            return chunks[i >> CHUNK_BITS].load(memory_order_acquire)[i & (CHUNK_SIZE - 1)];
+        }
+
+    private:
+        atomic<uint32_t> count;
+        atomic<T *> *chunks;
+        mutex growLock;
+        uint32_t viewedChunks = 0; // Leading chunks that point into an array the arena does not own
+        uint32_t viewedCount = 0; // Length of that array
+
+        void ensureChunks(uint32_t firstChunk, uint32_t lastChunk)
+        {
+            if (lastChunk >= MAX_CHUNKS)
+            {
+                throw bad_alloc();
+            }
+            if (viewedChunks > 0) // Growing must not write into the viewed array; not thread-safe, but nothing grows concurrently right after view
+            {
+                own();
+            }
+            for (uint32_t c = firstChunk; c <= lastChunk; ++c)
+            {
+                if (chunks[c].load(memory_order_acquire) == nullptr)
+                {
+                    lock_guard<mutex> guard(growLock);
+                    if (chunks[c].load(memory_order_relaxed) == nullptr)
+                    {
+                        chunks[c].store(new T[CHUNK_SIZE](), memory_order_release);
+                    }
+                }
+            }
+        }
+};
+
+#endif
@@ -1,144 +1,1319 @@
+#include <random>
+#include <cmath>
+#include <cfloat>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <glm/gtc/matrix_inverse.hpp>
+#include <glm/gtc/type_ptr.hpp>
 #include "BSPTree.h"
+#include "Hash.h"
 
-void BSPTree::insertFaces(vector<Face> object, mat4x4 transformation, GLfloat *diffuse, GLfloat *specular, GLfloat *shininess, GLfloat *emission)
+static const uint8_t PLACED_HERE = 1; // Bits of BSPTree::placedNodes
+static const uint8_t ON_PLACEMENT_PATH = 2;
+static const uint32_t ALL_FRUSTUM_PLANES = 0x3F;
+
+BSPTree::BSPTree(MaterialTable *materials, SplitterPolicy policy, int sampleSize, float splitWeight)
+: materials(materials), splitterPolicy(policy), sampleSize(sampleSize), splitWeight(splitWeight)
+{}
+
+uint32_t BSPTree::insertFaces(const vector<Face> &object, const mat4x4 &transformation, uint16_t material)
+{
+    ownTree();
+    size_t firstFace = faces.size();
+
+    // Lay out the corners as arrays and transform them in two batches
+    vector<vec3> positions(object.size() * 3);
+    vector<vec3> normals(object.size() * 3);
+    for (size_t i = 0; i < object.size(); ++i)
+    {
+        const Face &face = object[i];
+        positions[3 * i] = face.v1;
+        positions[3 * i + 1] = face.v2;
+        positions[3 * i + 2] = face.v3;
+        normals[3 * i] = face.n1;
+        normals[3 * i + 1] = face.n2;
+        normals[3 * i + 2] = face.n3;
+    }
+    transformPoints(transformation, positions.data(), positions.size(), positions.data());
+    transformNormals(inverseTranspose(mat3(transformation)), normals.data(), normals.size(), normals.data());
+
+    uint32_t first = faceStore.addVertices(positions.data(), normals.data(), positions.size());
+    for (uint32_t i = 0; i < object.size(); ++i)
+    {
+        Triangle transformed = {first + 3 * i, first + 3 * i + 1, first + 3 * i + 2};
+        if (isDegenerate(transformed))
+        {
+            continue; // Has no plane; it would have been dropped by its first classification anyway
+        }
+        faces.push_back(faceStore.addFace(transformed, material, objectCount));
+    }
+
+    return finishInsert(firstFace);
+}
+
+uint32_t BSPTree::insertMesh(const Mesh &mesh, const mat4x4 &transformation, uint16_t material)
+{
+    ownTree();
+    size_t firstFace = faces.size();
+
+    // Every position and normal of the file is transformed once, however many faces share it
+    vector<vec3> positions(mesh.positions.size());
+    vector<vec3> normals(mesh.normals.size());
+    transformPoints(transformation, mesh.positions.data(), positions.size(), positions.data());
+    transformNormals(inverseTranspose(mat3(transformation)), mesh.normals.data(), normals.size(), normals.data());
+
+    // A store vertex per distinct pair of position and normal
+    unordered_map<uint64_t, uint32_t> vertices;
+    vertices.reserve(mesh.positions.size());
+
+    for (size_t i = 0; i + 2 < mesh.corners.size(); i += 3)
+    {
+        const MeshCorner *c = &mesh.corners[i];
+        if (c[0].position >= positions.size() || c[1].position >= positions.size() || c[2].position >= positions.size())
+        {
+            continue; // Refers to a vertex the file does not have
+        }
+
+        const vec3 &p1 = positions[c[0].position];
+        const vec3 &p2 = positions[c[1].position];
+        const vec3 &p3 = positions[c[2].position];
+        vec3 faceNormal = normalize(cross(p2 - p1, p3 - p1)); // For corners without a normal
+
+        uint32_t v[3];
+        for (int k = 0; k < 3; ++k)
+        {
+            if (c[k].normal >= normals.size())
+            {
+                v[k] = faceStore.addVertex(positions[c[k].position], faceNormal); // Belongs to this face alone
+                continue;
+            }
+
+            uint64_t key = (uint64_t) c[k].position << 32 | c[k].normal;
+            auto found = vertices.find(key);
+            if (found == vertices.end())
+            {
+                found = vertices.emplace(key, faceStore.addVertex(positions[c[k].position], normals[c[k].normal])).first;
+            }
+            v[k] = found->second;
+        }
+
+        Triangle triangle = {v[0], v[1], v[2]};
+        if (isDegenerate(triangle))
+        {
+            continue;
+        }
+        faces.push_back(faceStore.addFace(triangle, material, objectCount));
+    }
+
+    return finishInsert(firstFace);
+}
+
+uint32_t BSPTree::finishInsert(size_t firstFace)
+{
+    if (isBuilt) // Only the new faces are classified, down the nodes they reach
+    {
+        isOverBudget = memoryBudget > 0 && getTreeMemory() > memoryBudget; // Whether the last build ran over says nothing about the tree now
+        vector<uint32_t> newFaces;
+        separateOpaqueFaces(vector<uint32_t>(faces.begin() + firstFace, faces.end()), &newFaces);
+        root = pushDown(root, newFaces);
+        compactTree(); // Leaves rebuilt by pushDown leave their old node and span behind
+        updateBounds();
+        placeDynamicObjects(placementEye); // The node indices the placements refer to have changed
+        renderer.invalidate();
+    }
+    return objectCount++;
+}
+
+void BSPTree::removeObject(uint32_t object)
+{
+    ownTree();
+    auto isOfObject = [&](uint32_t f) { return faceStore.objectId(f) == object; };
+    faces.erase(remove_if(faces.begin(), faces.end(), isOfObject), faces.end());
+    opaqueFaces.erase(remove_if(opaqueFaces.begin(), opaqueFaces.end(), isOfObject), opaqueFaces.end());
+    if (!isBuilt)
+    {
+        return;
+    }
+
+    // Children are always allocated after their parent, so one backward sweep sees every subtree before its root.
+    // Nodes of the object keep their plane to separate the rest, and leaves left without a face are cut off.
+    auto isEmpty = [&](uint32_t index)
+    {
+        return index != NULL_INDEX && nodes[index].faceCount == 0 && nodes[index].back == NULL_INDEX && nodes[index].front == NULL_INDEX;
+    };
+    for (uint32_t i = nodes.size(); i-- > 0;)
+    {
+        Node &node = nodes[i];
+        uint32_t kept = 0; // The rest of the span moves up in place
+        for (uint32_t k = 0; k < node.faceCount; ++k)
+        {
+            uint32_t f = nodeFaces[node.firstFace + k];
+            if (faceStore.objectId(f) != object)
+            {
+                nodeFaces[node.firstFace + kept++] = f;
+            }
+        }
+        node.faceCount = kept;
+        if (isEmpty(node.back))
+        {
+            node.back = NULL_INDEX;
+        }
+        if (isEmpty(node.front))
+        {
+            node.front = NULL_INDEX;
+        }
+    }
+    if (isEmpty(root))
+    {
+        root = NULL_INDEX;
+    }
+    compactTree(); // Drops the leaves cut off above
+    updateBounds();
+    placeDynamicObjects(placementEye);
+}
+
+// Children are allocated after their parent, so a backward sweep over the nodes sees every subtree before its root
+void BSPTree::updateBounds()
+{
+    for (uint32_t i = nodes.size(); i-- > 0;)
+    {
+        Node &node = nodes[i];
+        node.lowest = vec3(INFINITY, INFINITY, INFINITY); // Empty
+        node.highest = -node.lowest;
+
+        for (uint32_t k = 0; k < node.faceCount; ++k)
+        {
+            const Triangle &t = faceStore.triangle(nodeFaces[node.firstFace + k]);
+            for (uint32_t v : {t.v1, t.v2, t.v3})
+            {
+                node.lowest = min(node.lowest, faceStore.position(v));
+                node.highest = max(node.highest, faceStore.position(v));
+            }
+        }
+        for (uint32_t child : {node.back, node.front})
+        {
+            if (child != NULL_INDEX)
+            {
+                node.lowest = min(node.lowest, nodes[child].lowest);
+                node.highest = max(node.highest, nodes[child].highest);
+            }
+        }
+    }
+}
+
+// Drops the nodes no longer reachable from the root and the parts of nodeFaces no node refers to.
+// Nodes move down in index order, so children still follow their parents.
+void BSPTree::compactTree()
+{
+    vector<uint32_t> newIndices(nodes.size(), NULL_INDEX);
+    vector<bool> isReachable(nodes.size(), false);
+    uint32_t nodeCount = 0;
+    uint32_t faceCount = 0;
+    if (root != NULL_INDEX)
+    {
+        isReachable[root] = true;
+    }
+    for (uint32_t i = 0; i < nodes.size(); ++i) // Parents come first, so one forward sweep reaches every node
+    {
+        if (!isReachable[i])
+        {
+            continue;
+        }
+        newIndices[i] = nodeCount++;
+        faceCount += nodes[i].faceCount;
+        for (uint32_t child : {nodes[i].back, nodes[i].front})
+        {
+            if (child != NULL_INDEX)
+            {
+                isReachable[child] = true;
+            }
+        }
+    }
+    if (nodeCount == nodes.size() && faceCount == nodeFaces.size())
+    {
+        return;
+    }
+
+    vector<uint32_t> spans; // Spans may be out of node order, so they are gathered before they are written back
+    spans.reserve(faceCount);
+    for (uint32_t i = 0; i < nodes.size(); ++i)
+    {
+        if (newIndices[i] == NULL_INDEX)
+        {
+            continue;
+        }
+        Node node = nodes[i];
+        uint32_t firstFace = spans.size();
+        for (uint32_t k = 0; k < node.faceCount; ++k)
+        {
+            spans.push_back(nodeFaces[node.firstFace + k]);
+        }
+        node.firstFace = firstFace;
+        node.back = node.back == NULL_INDEX ? NULL_INDEX : newIndices[node.back];
+        node.front = node.front == NULL_INDEX ? NULL_INDEX : newIndices[node.front];
+        nodes[newIndices[i]] = node; // Never above i
+    }
+    for (uint32_t k = 0; k < faceCount; ++k)
+    {
+        nodeFaces[k] = spans[k];
+    }
+    nodes.truncate(nodeCount);
+    nodeFaces.truncate(faceCount);
+    root = root == NULL_INDEX ? NULL_INDEX : newIndices[root];
+}
+
+// Moves the opaque faces into opaqueFaces when opaquePass is set and hands back the rest
+void BSPTree::separateOpaqueFaces(const vector<uint32_t> &facesToSort, vector<uint32_t> *outTranslucentFaces)
+{
+    if (!opaquePass)
+    {
+        outTranslucentFaces->insert(outTranslucentFaces->end(), facesToSort.begin(), facesToSort.end());
+        return;
+    }
+
+    size_t firstNew = opaqueFaces.size();
+    for (uint32_t f : facesToSort)
+    {
+        if (materials->isTranslucent(faceStore.materialId(f)))
+        {
+            outTranslucentFaces->push_back(f);
+        }
+        else
+        {
+            opaqueFaces.push_back(f);
+        }
+    }
+
+    // Grouped by material so that the renderer draws each material with one call
+    if (opaqueFaces.size() > firstNew)
+    {
+        stable_sort(opaqueFaces.begin(), opaqueFaces.end(), [&](uint32_t a, uint32_t b)
+        {
+            return faceStore.materialId(a) < faceStore.materialId(b);
+        });
+    }
+}
+
+void BSPTree::setOpaquePass(bool enabled)
+{
+    opaquePass = enabled;
+}
+
+void BSPTree::setRobustSplitting(bool enabled)
+{
+    robustSplitting = enabled;
+}
+
+void BSPTree::setLeafSize(int maxFaces)
+{
+    leafSize = maxFaces;
+}
+
+void BSPTree::setMemoryBudget(size_t bytes)
+{
+    memoryBudget = bytes;
+}
+
+size_t BSPTree::getPeakMemory() const
+{
+    return peakMemory;
+}
+
+Face BSPTree::getFace(uint32_t face) const
+{
+    return faceStore.getFace(face);
+}
+
+const BuildStats &BSPTree::getBuildStats() const
+{
+    return buildStats;
+}
+
+void BSPTree::setFrameStats(bool enabled)
+{
+    collectFrameStats = enabled;
+    frameStats = FrameStats();
+}
+
+const FrameStats &BSPTree::getFrameStats() const
+{
+    return frameStats;
+}
+
+// Rounding errors of the float distances grow with the magnitude of the coordinates, so the tolerance follows the vertex farthest from the origin
+void BSPTree::updateTolerance()
+{
+    if (!robustSplitting)
+    {
+        planeTolerance = eps1;
+        return;
+    }
+
+    vec3 center;
+    float radius;
+    getBounds(&center, &radius);
+    planeTolerance = max((length(center) + radius) * ROBUST_TOLERANCE, FLT_MIN);
+}
+
+void BSPTree::ownTree()
+{
+    nodes.own();
+    nodeFaces.own();
+    faceStore.own();
+    treeFile.reset();
+}
+
+void BSPTree::setBuildThreads(int threadCount, int parallelCutoff)
+{
+    buildThreads = threadCount;
+    this->parallelCutoff = parallelCutoff;
+}
+
+static double millisecondsSince(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+void BSPTree::build()
+{
+    auto phaseStart = chrono::steady_clock::now();
+    buildStats = BuildStats();
+    for (atomic<uint32_t> &count : threePieceSplits)
+    {
+        count = 0;
+    }
+    twoPieceSplits = 0;
+    discardedFragments = 0;
+    splitterNanoseconds = 0;
+
+    nodes.clear(); // Tear down a previous tree
+    nodeFaces.clear();
+    ownTree(); // In case the tree was loaded
+    faceStore.compact(&faces); // Drops the fragments it split off and the faces of removed objects
+    renderer.invalidate();
+    isBuilt = true;
+    updateTolerance();
+
+    opaqueFaces.clear();
+    vector<uint32_t> treeFaces; // The work buffer of the whole build
+    separateOpaqueFaces(faces, &treeFaces);
+    nodes.reserve(treeFaces.size()); // Every face ends up in at least one node, and most in a node of their own
+    nodeFaces.reserve(treeFaces.size());
+
+    isOverBudget = false;
+    workMemory = treeFaces.capacity() * sizeof(uint32_t);
+    peakMemory = 0;
+    trackMemory(0);
+    buildStats.inputFaces = treeFaces.size();
+    buildStats.prepareMs = millisecondsSince(phaseStart);
+    phaseStart = chrono::steady_clock::now();
+
+    if (buildThreads == 1)
+    {
+        root = makeNode(&treeFaces, 0, leafSize);
+    }
+    else
+    {
+        TaskPool taskPool(buildThreads);
+        pool = &taskPool;
+        root = makeNode(&treeFaces, 0, leafSize);
+        pool = nullptr;
+    }
+
+    workMemory = 0;
+    buildStats.partitionMs = millisecondsSince(phaseStart);
+    phaseStart = chrono::steady_clock::now();
+    updateBounds();
+    placeDynamicObjects(placementEye);
+    updateBuildStats();
+    buildStats.finishMs = millisecondsSince(phaseStart);
+}
+
+void BSPTree::updateBuildStats()
+{
+    buildStats.outputFaces = nodeFaces.size();
+    buildStats.fragments = faceStore.getFaceCount() - faces.size();
+    for (int k = 0; k < 3; ++k)
+    {
+        buildStats.threePieceSplits[k] = threePieceSplits[k];
+    }
+    buildStats.twoPieceSplits = twoPieceSplits;
+    buildStats.discardedFragments = discardedFragments;
+    buildStats.splitterMs = splitterNanoseconds / 1e6;
+    buildStats.nodeCount = nodes.size();
+    buildStats.bytes = getTreeMemory();
+    buildStats.peakBytes = peakMemory;
+
+    // Children are allocated after their parents, so depths follow in index order and subtree sizes in reverse
+    vector<uint32_t> depths(nodes.size(), 1);
+    vector<uint32_t> sizes(nodes.size(), 1);
+    uint64_t leafDepths = 0;
+    for (uint32_t i = 0; i < nodes.size(); ++i)
+    {
+        const Node &node = nodes[i];
+        for (uint32_t child : {node.back, node.front})
+        {
+            if (child != NULL_INDEX)
+            {
+                depths[child] = depths[i] + 1;
+            }
+        }
+        buildStats.maxDepth = max(buildStats.maxDepth, depths[i]);
+        if (node.back == NULL_INDEX && node.front == NULL_INDEX)
+        {
+            ++buildStats.leafCount;
+            leafDepths += depths[i];
+        }
+    }
+    double balance = 0.0;
+    uint32_t splitCount = 0; // Nodes with both subtrees
+    for (uint32_t i = nodes.size(); i-- > 0;)
+    {
+        const Node &node = nodes[i];
+        uint32_t back = node.back == NULL_INDEX ? 0 : sizes[node.back];
+        uint32_t front = node.front == NULL_INDEX ? 0 : sizes[node.front];
+        sizes[i] += back + front;
+        if (back > 0 && front > 0)
+        {
+            balance += (double) min(back, front) / max(back, front);
+            ++splitCount;
+        }
+    }
+    buildStats.averageDepth = buildStats.leafCount == 0 ? 0.0f : (float) leafDepths / buildStats.leafCount;
+    buildStats.balance = splitCount == 0 ? 1.0f : (float) (balance / splitCount);
+}
+
+// Byte offsets of the arrays in a tree file; the last one is the size of the file
+static void getTreeFileLayout(const TreeFileHeader &header, size_t outOffsets[9])
+{
+    size_t sizes[8] = {
+        header.nodeCount * sizeof(Node),
+        header.nodeFaceCount * sizeof(uint32_t),
+        header.vertexCount * sizeof(vec3),
+        header.vertexCount * sizeof(vec3),
+        header.faceCount * sizeof(Triangle),
+        header.faceCount * sizeof(Plane),
+        header.faceCount * sizeof(uint16_t),
+        header.faceCount * sizeof(uint32_t)
+    };
+
+    size_t offset = sizeof(TreeFileHeader);
+    for (int i = 0; i < 8; ++i)
+    {
+        offset = (offset + 63) & ~(size_t) 63;
+        outOffsets[i] = offset;
+        offset += sizes[i];
+    }
+    outOffsets[8] = offset;
+}
+
+template <typename T>
+static bool writeArena(FILE *file, const Arena<T> &arena, uint32_t n, size_t offset)
+{
+    static const char padding[64] = {};
+    long position = ftell(file);
+    if (position < 0 || fwrite(padding, 1, offset - position, file) != offset - position)
+    {
+        return false;
+    }
+
+    bool written = true;
+    arena.forEachSpan(0, n, [&](const T *span, uint32_t length)
+    {
+        written = written && fwrite(span, sizeof(T), length, file) == length;
+    });
+    return written;
+}
+
+bool BSPTree::save(const string &path) const
+{
+    TreeFileHeader header = {};
+    memcpy(header.magic, TREE_FILE_MAGIC, sizeof(header.magic));
+    header.version = TREE_FILE_VERSION;
+    header.sceneHash = getSceneHash();
+    header.root = root;
+    header.nodeCount = nodes.size();
+    header.nodeFaceCount = nodeFaces.size();
+    header.vertexCount = faceStore.getVertexCount();
+    header.faceCount = faceStore.getFaceCount();
+
+    size_t offsets[9];
+    getTreeFileLayout(header, offsets);
+
+    return replaceFile(path, [&](FILE *file)
+    {
+        return fwrite(&header, sizeof(header), 1, file) == 1
+            && writeArena(file, nodes, header.nodeCount, offsets[0])
+            && writeArena(file, nodeFaces, header.nodeFaceCount, offsets[1])
+            && writeArena(file, faceStore.getPositions(), header.vertexCount, offsets[2])
+            && writeArena(file, faceStore.getNormals(), header.vertexCount, offsets[3])
+            && writeArena(file, faceStore.getTriangles(), header.faceCount, offsets[4])
+            && writeArena(file, faceStore.getPlanes(), header.faceCount, offsets[5])
+            && writeArena(file, faceStore.getMaterialIds(), header.faceCount, offsets[6])
+            && writeArena(file, faceStore.getObjectIds(), header.faceCount, offsets[7]);
+    });
+}
+
+// Checks every index of a tree file against the array it points into, so that a damaged file cannot make the tree read out of bounds
+static bool isValidTreeFile(const TreeFileHeader &header, const char *data, const size_t offsets[9], int materialCount)
+{
+    const Node *fileNodes = (const Node *) (data + offsets[0]);
+    vector<bool> hasParent(header.nodeCount, false);
+    for (uint32_t i = 0; i < header.nodeCount; ++i)
+    {
+        const Node &node = fileNodes[i];
+        if ((uint64_t) node.firstFace + node.faceCount > header.nodeFaceCount || node.kind > CONCAVE_LEAF)
+        {
+            return false;
+        }
+        for (uint32_t child : {node.back, node.front})
+        {
+            if (child == NULL_INDEX)
+            {
+                continue;
+            }
+            if (child <= i || child >= header.nodeCount || hasParent[child] || child == header.root) // Children follow their parent, so there are no cycles
+            {
+                return false;
+            }
+            hasParent[child] = true;
+        }
+    }
+
+    const uint32_t *fileNodeFaces = (const uint32_t *) (data + offsets[1]);
+    for (uint32_t i = 0; i < header.nodeFaceCount; ++i)
+    {
+        if (fileNodeFaces[i] >= header.faceCount)
+        {
+            return false;
+        }
+    }
+
+    const Triangle *triangles = (const Triangle *) (data + offsets[4]);
+    const uint16_t *materialIds = (const uint16_t *) (data + offsets[6]);
+    for (uint32_t f = 0; f < header.faceCount; ++f)
+    {
+        if (triangles[f].v1 >= header.vertexCount || triangles[f].v2 >= header.vertexCount || triangles[f].v3 >= header.vertexCount
+            || materialIds[f] >= materialCount)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BSPTree::load(const string &path)
+{
+    unique_ptr<MappedFile> file(new MappedFile(path));
+    if (!file->isOpen() || file->size() < sizeof(TreeFileHeader))
+    {
+        return false;
+    }
+
+    TreeFileHeader header;
+    memcpy(&header, file->data(), sizeof(header));
+    if (memcmp(header.magic, TREE_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != TREE_FILE_VERSION
+        || header.sceneHash != getSceneHash())
+    {
+        return false;
+    }
+
+    size_t offsets[9];
+    getTreeFileLayout(header, offsets);
+    if (offsets[8] != file->size() || (!faces.empty() && faces.back() >= header.faceCount)
+        || (header.root >= header.nodeCount && !(header.root == NULL_INDEX && header.nodeCount == 0)))
+    {
+        return false;
+    }
+
+    // The nodes and faces are read from the mapping in place; nothing is copied until the next build
+    const char *data = file->data();
+    if (!isValidTreeFile(header, data, offsets, materials->size()))
+    {
+        return false;
+    }
+    nodes.view((const Node *) (data + offsets[0]), header.nodeCount);
+    nodeFaces.view((const uint32_t *) (data + offsets[1]), header.nodeFaceCount);
+    faceStore.view((const vec3 *) (data + offsets[2]), (const vec3 *) (data + offsets[3]), header.vertexCount,
+        (const Triangle *) (data + offsets[4]), (const Plane *) (data + offsets[5]), (const uint16_t *) (data + offsets[6]),
+        (const uint32_t *) (data + offsets[7]), header.faceCount);
+    treeFile = move(file);
+    root = header.root;
+    isBuilt = true;
+    updateTolerance(); // For faces inserted later
+    buildStats = BuildStats(); // Nothing was built
+
+    opaqueFaces.clear(); // Inserted faces are never split, so the opaque ones follow from the materials again
+    vector<uint32_t> treeFaces;
+    separateOpaqueFaces(faces, &treeFaces);
+    placeDynamicObjects(placementEye);
+    renderer.invalidate();
+    return true;
+}
+
+uint64_t BSPTree::getSceneHash() const
+{
+    uint64_t hash = fnv1a(&TREE_FILE_VERSION, sizeof(TREE_FILE_VERSION));
+    hash = fnv1a(&splitterPolicy, sizeof(splitterPolicy), hash);
+    hash = fnv1a(&sampleSize, sizeof(sampleSize), hash);
+    hash = fnv1a(&splitWeight, sizeof(splitWeight), hash);
+    hash = fnv1a(&opaquePass, sizeof(opaquePass), hash);
+    hash = fnv1a(&robustSplitting, sizeof(robustSplitting), hash);
+    hash = fnv1a(&leafSize, sizeof(leafSize), hash);
+    hash = fnv1a(&memoryBudget, sizeof(memoryBudget), hash);
+    for (int i = 0; opaquePass && i < materials->size(); ++i) // Which faces went into the tree
+    {
+        bool isTranslucent = materials->isTranslucent(i);
+        hash = fnv1a(&isTranslucent, sizeof(isTranslucent), hash);
+    }
+
+    // Split fragments follow from the inserted faces, so those are all that is hashed.
+    // Their corners are hashed rather than their vertex indices, which the next build renumbers.
+    hash = fnv1a(faces.data(), faces.size() * sizeof(uint32_t), hash);
+    for (uint32_t f : faces)
+    {
+        const Triangle &t = faceStore.triangle(f);
+        vec3 corners[6] = {faceStore.position(t.v1), faceStore.position(t.v2), faceStore.position(t.v3),
+            faceStore.normal(t.v1), faceStore.normal(t.v2), faceStore.normal(t.v3)};
+        uint16_t material = faceStore.materialId(f);
+        uint32_t object = faceStore.objectId(f);
+        hash = fnv1a(corners, sizeof(corners), hash);
+        hash = fnv1a(&material, sizeof(material), hash);
+        hash = fnv1a(&object, sizeof(object), hash);
+    }
+    return hash;
+}
+
+uint32_t BSPTree::makeNode(const vector<uint32_t> &facesToClassify)
+{
+    vector<uint32_t> work(facesToClassify);
+    size_t bytes = work.capacity() * sizeof(uint32_t);
+    workMemory += bytes;
+    uint32_t index = makeNode(&work, 0, leafSize);
+    workMemory -= work.capacity() * sizeof(uint32_t); // Including what makeNode grew it by
+    return index;
+}
+
+// Builds the subtree of the faces in (*work)[begin, work->size()) and shrinks work back to begin.
+// The faces are partitioned within that range like in quicksort, and each side is built at the top of work in turn.
+// Besides work, a node only holds the fragments split off at it while its back subtree is built.
+uint32_t BSPTree::makeNode(vector<uint32_t> *work, size_t begin, uint32_t leafTestSize)
+{
+    uint32_t count = work->size() - begin;
+    if (count == 0) // Check first
+    {
+        return NULL_INDEX;
+    }
+
+    if (count <= leafTestSize) // Small enough for a leaf if its faces need no splitting to be ordered
+    {
+        NodeKind kind = getLeafKind(work->data() + begin, count);
+        leafTestSize = count / 2; // A failed cell mostly loses a face or two per split, so its subcells are tested again only once they have halved
+        if (kind != SPLIT_NODE)
+        {
+            uint32_t index = nodes.allocate();
+            Node *leaf = &nodes[index];
+            leaf->kind = kind;
+            leaf->plane = faceStore.plane((*work)[begin]); // Only places dynamic objects
+            vector<uint32_t> faceIds(work->begin() + begin, work->end());
+            setNodeFaces(leaf, &faceIds);
+            work->resize(begin);
+            return index;
+        }
+    }
+
+    uint32_t index = nodes.allocate();
+    Node *node = &nodes[index]; // Stays in place while other nodes are allocated
+
+    vector<uint32_t> frontPieces; // Fragments of the faces spanning the plane
+    vector<uint32_t> backPieces;
+    size_t middle; // Front faces are moved before it and back faces after it
+
+    {
+        uint32_t *faceIds = work->data() + begin;
+        TriangleCoords coords; // Gathered once, then streamed through for every candidate and the final classification
+        gatherTriangles(faceIds, count, &coords);
+
+        auto splitterStart = chrono::steady_clock::now();
+        uint32_t splitter = chooseSplitter(faceIds, coords);
+        splitterNanoseconds += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - splitterStart).count();
+        node->plane = faceStore.plane(faceIds[splitter]);
+
+        vector<uint8_t> sides(count);
+        classifySides(node->plane, coords, sides.data());
+        trackMemory(coords.coords.capacity() * sizeof(float) + sides.capacity());
+
+        // Faces lying in the plane need no further ordering, so they stay in this node with the splitter.
+        // They and the spanning faces are compacted out of the range first.
+        vector<uint32_t> coplanarFaces(1, faceIds[splitter]);
+        sides[splitter] = SIDE_COPLANAR;
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            if (sides[i] == SIDE_FRONT || sides[i] == SIDE_BACK)
+            {
+                faceIds[kept] = faceIds[i];
+                sides[kept] = sides[i];
+                ++kept;
+            }
+            else if (sides[i] == SIDE_SPANNING)
+            {
+                classify(node->plane, faceIds[i], &frontPieces, &backPieces);
+            }
+            else if (i != splitter)
+            {
+                coplanarFaces.push_back(faceIds[i]);
+            }
+        }
+
+        // Then the rest is swapped into front and back faces like in quicksort
+        uint32_t front = 0;
+        uint32_t back = kept;
+        while (front < back)
+        {
+            if (sides[front] == SIDE_FRONT)
+            {
+                ++front;
+            }
+            else
+            {
+                --back;
+                swap(faceIds[front], faceIds[back]);
+                swap(sides[front], sides[back]);
+            }
+        }
+        setNodeFaces(node, &coplanarFaces);
+        middle = begin + front;
+        work->resize(begin + kept);
+    }
+
+    if (pool != nullptr && middle - begin + frontPieces.size() >= parallelCutoff && work->size() - middle + backPieces.size() >= parallelCutoff)
+    {
+        // Both subtrees are independent from here on; let an idle worker take the front one in a work buffer of its own
+        vector<uint32_t> frontWork;
+        frontWork.reserve(middle - begin + frontPieces.size());
+        frontWork.assign(work->begin() + begin, work->begin() + middle);
+        workMemory += frontWork.capacity() * sizeof(uint32_t);
+        appendWork(&frontWork, &frontPieces);
+        work->erase(work->begin() + begin, work->begin() + middle);
+        appendWork(work, &backPieces);
+
+        atomic<int> pending(1);
+        pool->submit([&]()
+        {
+            node->front = makeNode(&frontWork, 0, leafTestSize);
+            --pending;
+        });
+        node->back = makeNode(work, begin, leafTestSize);
+        pool->wait(pending);
+        workMemory -= frontWork.capacity() * sizeof(uint32_t);
+    }
+    else
+    {
+        appendWork(work, &backPieces);
+        node->back = makeNode(work, middle, leafTestSize);
+
+        appendWork(work, &frontPieces);
+        node->front = makeNode(work, begin, leafTestSize);
+    }
+
+    work->resize(begin);
+    return index;
+}
+
+// Moves the fragments split off at a node to the top of work, for the subtree they belong to
+void BSPTree::appendWork(vector<uint32_t> *work, vector<uint32_t> *pieces)
+{
+    size_t capacity = work->capacity();
+    work->insert(work->end(), pieces->begin(), pieces->end());
+    vector<uint32_t>().swap(*pieces);
+    workMemory += (work->capacity() - capacity) * sizeof(uint32_t);
+    trackMemory(0);
+}
+
+size_t BSPTree::getTreeMemory() const
+{
+    size_t faceBytes = sizeof(Triangle) + sizeof(Plane) + sizeof(uint16_t) + sizeof(uint32_t); // Columns of the face store
+    return (size_t) nodes.size() * sizeof(Node) + (size_t) nodeFaces.size() * sizeof(uint32_t) + opaqueFaces.capacity() * sizeof(uint32_t) +
+        (size_t) faceStore.getVertexCount() * 2 * sizeof(vec3) + (size_t) faceStore.getFaceCount() * faceBytes;
+}
+
+// Records the bytes the build holds now, with temporaryBytes held by the calling thread on top of the tree and the work buffers
+void BSPTree::trackMemory(size_t temporaryBytes)
+{
+    size_t bytes = getTreeMemory() + workMemory + temporaryBytes;
+    size_t peak = peakMemory;
+    while (bytes > peak && !peakMemory.compare_exchange_weak(peak, bytes))
+    {
+    }
+    if (memoryBudget > 0 && bytes > memoryBudget)
+    {
+        isOverBudget = true;
+    }
+}
+
+// Stores the faces as the span of the node, grouped by material so that each material is drawn with one call
+void BSPTree::setNodeFaces(Node *node, vector<uint32_t> *faceIds)
+{
+    stable_sort(faceIds->begin(), faceIds->end(), [&](uint32_t a, uint32_t b)
+    {
+        return faceStore.materialId(a) < faceStore.materialId(b);
+    });
+    node->firstFace = nodeFaces.allocate(faceIds->size());
+    node->faceCount = faceIds->size();
+    for (uint32_t k = 0; k < node->faceCount; ++k)
+    {
+        nodeFaces[node->firstFace + k] = (*faceIds)[k];
+    }
+}
+
+// Faces that all lie on the same side of each other's planes are crossed at most twice by any ray, entering through one and leaving through another.
+// Their order then only depends on which of them face the camera, so a leaf can hold them without further splits.
+NodeKind BSPTree::getLeafKind(const uint32_t *faceIds, uint32_t count) const
+{
+    bool isConvex = true;
+    bool isConcave = true;
+    for (uint32_t a = 0; a < count; ++a)
+    {
+        const Plane &plane = faceStore.plane(faceIds[a]);
+        for (uint32_t b = 0; b < count; ++b)
+        {
+            const Triangle &t = faceStore.triangle(faceIds[b]);
+            for (uint32_t v : {t.v1, t.v2, t.v3})
+            {
+                float d = distFromPlane(plane.N, plane.D, faceStore.position(v));
+                isConvex = isConvex && d <= planeTolerance;
+                isConcave = isConcave && d >= -planeTolerance;
+            }
+            if (!isConvex && !isConcave) // Most cells fail within a few pairs
+            {
+                return SPLIT_NODE;
+            }
+        }
+    }
+    return isConvex ? CONVEX_LEAF : CONCAVE_LEAF;
+}
+
+uint32_t BSPTree::pushDown(uint32_t index, const vector<uint32_t> &facesToPush)
 {
-    mat4x4 normalTransformation = transformation; // Normals don't take effect of translation 
-    normalTransformation[3].x = 0;
-    normalTransformation[3].y = 0;
-    normalTransformation[3].z = 0;
+    if (facesToPush.empty())
+    {
+        return index;
+    }
+    if (index == NULL_INDEX) // Past a leaf; the faces make up a new subtree
+    {
+        return makeNode(facesToPush);
+    }
+    if (nodes[index].kind != SPLIT_NODE) // The leaf's faces are not ordered by its plane, so the leaf is built again with the new faces
+    {
+        vector<uint32_t> cellFaces(facesToPush);
+        const Node &leaf = nodes[index];
+        for (uint32_t k = 0; k < leaf.faceCount; ++k)
+        {
+            cellFaces.push_back(nodeFaces[leaf.firstFace + k]);
+        }
+        return makeNode(cellFaces);
+    }
 
-    for (Face face : object)
+    vector<uint32_t> frontFaces;
+    vector<uint32_t> backFaces;
     {
-        Face transformedFace;
+        TriangleCoords coords;
+        gatherTriangles(facesToPush.data(), facesToPush.size(), &coords);
+        partition(nodes[index].plane, facesToPush, coords, -1, &frontFaces, &backFaces);
+    }
 
-        transformedFace.v1 = transformPoint(transformation, face.v1);
-        transformedFace.v2 = transformPoint(transformation, face.v2);
-        transformedFace.v3 = transformPoint(transformation, face.v3);
+    uint32_t front = pushDown(nodes[index].front, frontFaces);
+    uint32_t back = pushDown(nodes[index].back, backFaces);
+    nodes[index].front = front;
+    nodes[index].back = back;
+    return index;
+}
 
-        transformedFace.n1 = transformPoint(normalTransformation, face.n1);
-        transformedFace.n2 = transformPoint(normalTransformation, face.n2);
-        transformedFace.n3 = transformPoint(normalTransformation, face.n3);
+// Sort the faces, except the splitter itself, into the front and back of plane.
+// Faces lying in the plane go to coplanarFaces if given, and otherwise to the side they face.
+void BSPTree::partition(const Plane &plane, const vector<uint32_t> &facesToClassify, const TriangleCoords &coords, int splitter, vector<uint32_t> *frontFaces, vector<uint32_t> *backFaces, vector<uint32_t> *coplanarFaces)
+{
+    vector<uint8_t> sides(coords.count);
+    classifySides(plane, coords, sides.data());
 
-        transformedFace.diffuse = diffuse;
-        transformedFace.specular = specular;
-        transformedFace.shininess = shininess;
-        transformedFace.emission = emission;
+    for (int i = 0; i < (int) facesToClassify.size(); ++i)
+    {
+        if (i == splitter)
+        {
+            continue;
+        }
 
-        faces.push_back(transformedFace);
+        if (sides[i] == SIDE_FRONT)
+        {
+            frontFaces->push_back(facesToClassify[i]);
+        }
+        else if (sides[i] == SIDE_BACK)
+        {
+            backFaces->push_back(facesToClassify[i]);
+        }
+        else if (sides[i] == SIDE_COPLANAR && coplanarFaces != nullptr)
+        {
+            coplanarFaces->push_back(facesToClassify[i]);
+        }
+        else if (sides[i] == SIDE_COPLANAR) // Goes to the side it faces, so coplanar faces stay together
+        {
+            bool isFacingFront = dot(faceStore.plane(facesToClassify[i]).N, plane.N) >= 0.0f;
+            (isFacingFront ? frontFaces : backFaces)->push_back(facesToClassify[i]);
+        }
+        else // Only spanning faces take the slow path
+        {
+            classify(plane, facesToClassify[i], frontFaces, backFaces);
+        }
     }
 }
 
-void BSPTree::build()
+void BSPTree::gatherTriangles(const uint32_t *faceIds, int count, TriangleCoords *outCoords) const
 {
-    root = makeNode(faces);
+    int stride = (count + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH;
+    outCoords->count = count;
+    outCoords->stride = stride;
+    outCoords->coords.assign(9 * stride, 0.0f);
+
+    float *coords = outCoords->coords.data();
+    for (int i = 0; i < count; ++i)
+    {
+        const Triangle &t = faceStore.triangle(faceIds[i]);
+        const vec3 *corners[3] = {&faceStore.position(t.v1), &faceStore.position(t.v2), &faceStore.position(t.v3)};
+        for (int k = 0; k < 3; ++k)
+        {
+            coords[(3 * k) * stride + i] = corners[k]->x;
+            coords[(3 * k + 1) * stride + i] = corners[k]->y;
+            coords[(3 * k + 2) * stride + i] = corners[k]->z;
+        }
+    }
 }
 
-Node *BSPTree::makeNode(const vector<Face> &facesToClassify)
+int BSPTree::chooseSplitter(const uint32_t *faceIds, const TriangleCoords &coords)
 {
-    if (facesToClassify.size() == 0) // Check first
+    int faceCount = coords.count;
+    SplitterPolicy policy = splitterPolicy;
+    if (isOverBudget && policy != FIRST_FACE) // Fewer splits leave fewer fragments to hold
+    {
+        policy = LEAST_SPLITS;
+    }
+    if (policy == FIRST_FACE || faceCount <= 2)
+    {
+        return 0;
+    }
+
+    int candidateCount = (sampleSize <= 0 || sampleSize > faceCount) ? faceCount : sampleSize;
+    minstd_rand rng(faceCount); // Seeded by the input so that the same faces always yield the same tree
+
+    vector<uint8_t> sides(faceCount);
+    int best = 0;
+    float bestScore = INFINITY;
+    for (int i = 0; i < candidateCount; ++i)
     {
-        return nullptr;
+        int candidate;
+        if (policy == RANDOM_SAMPLE)
+        {
+            candidate = rng() % faceCount;
+        }
+        else
+        {
+            candidate = (int) ((long long) i * faceCount / candidateCount); // Evenly strided candidates
+        }
+
+        float score = scoreSplitter(faceIds, coords, candidate, policy, sides.data());
+        if (score < bestScore)
+        {
+            bestScore = score;
+            best = candidate;
+            if (score == 0.0f) // Cannot do any better
+            {
+                break;
+            }
+        }
     }
 
-    Node *node = new Node(); // Dynamically allocate to prevent from being deleted
+    return best;
+}
 
-    Face plane = *facesToClassify.begin(); // Plane
-    node->face = plane;
+float BSPTree::scoreSplitter(const uint32_t *faceIds, const TriangleCoords &coords, int candidate, SplitterPolicy policy, uint8_t *sides)
+{
+    classifySides(faceStore.plane(faceIds[candidate]), coords, sides);
 
-    vector<Face> frontFaces;
-    vector<Face> backFaces;
+    int counts[4] = {0, 0, 0, 0};
+    for (int i = 0; i < coords.count; ++i)
+    {
+        ++counts[sides[i]];
+    }
+    --counts[sides[candidate]]; // The candidate itself is not classified
 
-    for (int i = 1; i < facesToClassify.size(); ++i)
+    int splits = counts[SIDE_SPANNING];
+    if (policy == BALANCED)
     {
-        Face target = facesToClassify[i];
-        classify(plane, target, &frontFaces, &backFaces);
+        return splitWeight * splits + (1.0f - splitWeight) * abs(counts[SIDE_FRONT] - counts[SIDE_BACK]);
     }
+    return splits;
+}
 
-    node->front = makeNode(frontFaces);
-    node->back = makeNode(backFaces);
+bool BSPTree::isDegenerate(const Triangle &t) const
+{
+    const vec3 &p1 = faceStore.position(t.v1);
+    const vec3 &p2 = faceStore.position(t.v2);
+    const vec3 &p3 = faceStore.position(t.v3);
+
+    return distance(p1, p2) <= eps2 || distance(p2, p3) <= eps2 || distance(p3, p1) <= eps2;
+}
+
+bool BSPTree::isSliver(const Triangle &t) const
+{
+    const vec3 &p1 = faceStore.position(t.v1);
+    const vec3 &p2 = faceStore.position(t.v2);
+    const vec3 &p3 = faceStore.position(t.v3);
+
+    // Twice the area over the longest edge is the smallest height of the triangle
+    float longest = max(max(distance(p1, p2), distance(p2, p3)), distance(p3, p1));
+    return longest == 0.0f || length(cross(p2 - p1, p3 - p1)) < planeTolerance * longest;
+}
+
+void BSPTree::classifySides(const Plane &plane, const TriangleCoords &coords, uint8_t *outSides) const
+{
+    if (robustSplitting)
+    {
+        classifyTrianglesRobust(plane, coords.coords.data(), coords.stride, coords.count, planeTolerance, outSides);
+    }
+    else
+    {
+        classifyTriangles(plane, coords.coords.data(), coords.stride, coords.count, eps1, eps2, outSides);
+    }
+}
 
-    return node;
+void BSPTree::classify(uint32_t root, uint32_t target, vector<uint32_t> *frontFaces, vector<uint32_t> *backFaces)
+{
+    classify(faceStore.plane(root), target, frontFaces, backFaces); // Computed once when the face was added
 }
 
-void BSPTree::classify(Face root, Face target, vector<Face> *frontFaces, vector<Face> *backFaces)
+void BSPTree::classify(const Plane &plane, uint32_t target, vector<uint32_t> *frontFaces, vector<uint32_t> *backFaces)
 {
-    vec3 N = getNormal(root.v1, root.v2, root.v3);
-    float D = -(N.x * root.v1.x + N.y * root.v1.y + N.z * root.v1.z); // Define the plane equation
-    vec3 v1 = target.v1;
-    vec3 v2 = target.v2;
-    vec3 v3 = target.v3;
-    vec3 n1 = target.n1;
-    vec3 n2 = target.n2;
-    vec3 n3 = target.n3;
-    GLfloat *diffuse = target.diffuse;
-    GLfloat *specular = target.specular;
-    GLfloat *shininess = target.shininess;
-    GLfloat *emission = target.emission;
-    
+    if (robustSplitting)
+    {
+        splitRobustly(plane, target, frontFaces, backFaces);
+        return;
+    }
+
+    vec3 N = plane.N;
+    float D = plane.D;
+
+    const Triangle &t = faceStore.triangle(target);
+    uint32_t v1 = t.v1;
+    uint32_t v2 = t.v2;
+    uint32_t v3 = t.v3;
+    vec3 vertices[3] = {faceStore.position(v1), faceStore.position(v2), faceStore.position(v3)};
+    vec3 normals[3] = {faceStore.normal(v1), faceStore.normal(v2), faceStore.normal(v3)};
+
     vector<vec3> intersections;
-    vector<vec3> normals;
-    int flag = trianglePlaneIntersection(root, target, &intersections, &normals);
-    
-    vector<Face> unclassified;
+    vector<vec3> intersectionNormals;
+    int flag = trianglePlaneIntersection(plane, vertices, normals, &intersections, &intersectionNormals);
+
+    vector<Triangle> unclassified;
     if (intersections.size() == 2)
     {
-        vec3 i1 = intersections[0]; // First intersection point
-        vec3 i2 = intersections[1]; // Second intersection point
-        vec3 in1 = normals[0];
-        vec3 in2 = normals[1];
+        uint32_t i1 = faceStore.addVertex(intersections[0], intersectionNormals[0]); // First intersection point
+        uint32_t i2 = faceStore.addVertex(intersections[1], intersectionNormals[1]); // Second intersection point
 
-        if (flag == 3)
+        if (flag == 3) // v2 alone on its side
         {
-            Face f1(v1, i1, i2, n1, in1, in2, diffuse, specular, shininess, emission); // Fix normals!
-            Face f2(i1, v2, i2, in1, n2, in2, diffuse, specular, shininess, emission);
-            Face f3(v1, i2, v3, n1, in2, n3, diffuse, specular, shininess, emission);
-
-            unclassified.push_back(f1);
-            unclassified.push_back(f2);
-            unclassified.push_back(f3);
+            ++threePieceSplits[1];
+            unclassified.push_back({v1, i1, i2});
+            unclassified.push_back({i1, v2, i2});
+            unclassified.push_back({v1, i2, v3});
         }
-        else if (flag == 5)
+        else if (flag == 5) // v1 alone
         {
-            Face f1(v1, i1, i2, n1, in1, in2, diffuse, specular, shininess, emission); // Fix normals!
-            Face f2(i1, v2, i2, in1, n2, in2, diffuse, specular, shininess, emission);
-            Face f3(i2, v2, v3, in2, n2, n3, diffuse, specular, shininess, emission);
-
-            unclassified.push_back(f1);
-            unclassified.push_back(f2);
-            unclassified.push_back(f3);
+            ++threePieceSplits[0];
+            unclassified.push_back({v1, i1, i2});
+            unclassified.push_back({i1, v2, i2});
+            unclassified.push_back({i2, v2, v3});
         }
-        else if (flag == 6)
+        else if (flag == 6) // v3 alone
         {
-            Face f1(v1, v2, i1, n1, n2, in1, diffuse, specular, shininess, emission); // Fix normals!
-            Face f2(v1, i1, i2, n1, in1, in2, diffuse, specular, shininess, emission);
-            Face f3(i2, i1, v3, in2, in1, n3, diffuse, specular, shininess, emission);
-
-            unclassified.push_back(f1);
-            unclassified.push_back(f2);
-            unclassified.push_back(f3);
+            ++threePieceSplits[2];
+            unclassified.push_back({v1, v2, i1});
+            unclassified.push_back({v1, i1, i2});
+            unclassified.push_back({i2, i1, v3});
         }
     }
     else
     {
-        unclassified.push_back(target);
+        unclassified.push_back(t);
     }
 
-    for (Face f : unclassified)
+    bool isSplit = unclassified.size() > 1;
+    uint16_t material = faceStore.materialId(target);
+    uint32_t object = faceStore.objectId(target);
+    for (const Triangle &f : unclassified)
     {
-        if (distance(f.v1, f.v2) > eps2 && distance(f.v2, f.v3) > eps2 && distance(f.v3, f.v1) > eps2)
+        if (isDegenerate(f))
+        {
+            ++discardedFragments;
+        }
+        else
         {
-            if (distFromPlane(N, D, f.v1) + distFromPlane(N, D, f.v2) + distFromPlane(N, D, f.v3) >= eps2) // On the front side
+            const vec3 &p1 = faceStore.position(f.v1);
+            const vec3 &p2 = faceStore.position(f.v2);
+            const vec3 &p3 = faceStore.position(f.v3);
+
+            uint32_t face = isSplit ? faceStore.addFace(f, material, object, faceStore.plane(target)) : target; // Fragments lie on the plane of the original face
+
+            if (distFromPlane(N, D, p1) + distFromPlane(N, D, p2) + distFromPlane(N, D, p3) >= eps2) // On the front side
             {
-                frontFaces->push_back(f);
+                frontFaces->push_back(face);
             }
             else // On the back side
             {
-                backFaces->push_back(f);
+                backFaces->push_back(face);
             }
         }
     }
 }
 
+// Distances are taken in double precision, and a corner within planeTolerance of the plane counts as lying on it.
+// Such a corner is shared by both pieces instead of being cut off as a sliver, so a triangle splits into two pieces when a corner touches the plane and three otherwise.
+void BSPTree::splitRobustly(const Plane &plane, uint32_t target, vector<uint32_t> *frontFaces, vector<uint32_t> *backFaces)
+{
+    const Triangle &t = faceStore.triangle(target);
+    uint32_t v[3] = {t.v1, t.v2, t.v3};
+    dvec3 N(plane.N);
+    dvec3 p[3];
+    double d[3];
+    int sides[3]; // 1 in front, -1 behind, 0 on the plane
+    for (int k = 0; k < 3; ++k)
+    {
+        p[k] = dvec3(faceStore.position(v[k]));
+        d[k] = dot(N, p[k]) + plane.D;
+        sides[k] = d[k] > planeTolerance ? 1 : (d[k] < -planeTolerance ? -1 : 0);
+    }
+
+    bool hasFront = sides[0] > 0 || sides[1] > 0 || sides[2] > 0;
+    bool hasBack = sides[0] < 0 || sides[1] < 0 || sides[2] < 0;
+    if (!hasFront || !hasBack)
+    {
+        bool isFront = hasFront || (!hasBack && dot(faceStore.plane(target).N, plane.N) >= 0.0f); // A coplanar face goes to the side it faces
+        (isFront ? frontFaces : backFaces)->push_back(target);
+        return;
+    }
+
+    // Corner a is the one on the plane, or else the one alone on its side
+    int a = 0;
+    bool hasCornerOnPlane = sides[0] == 0 || sides[1] == 0 || sides[2] == 0;
+    for (int k = 0; k < 3; ++k)
+    {
+        if (hasCornerOnPlane ? sides[k] == 0 : sides[k] != sides[(k + 1) % 3] && sides[k] != sides[(k + 2) % 3])
+        {
+            a = k;
+            break;
+        }
+    }
+    int b = (a + 1) % 3;
+    int c = (a + 2) % 3;
+
+    auto cut = [&](int from, int to, vec3 *outPosition)
+    {
+        double s = d[from] / (d[from] - d[to]);
+        *outPosition = vec3(p[from] + s * (p[to] - p[from]));
+        vec3 n1 = faceStore.normal(v[from]);
+        vec3 n2 = faceStore.normal(v[to]);
+        return faceStore.addVertex(*outPosition, n1 + (float) s * (n2 - n1));
+    };
+
+    uint16_t material = faceStore.materialId(target);
+    uint32_t object = faceStore.objectId(target);
+    Plane facePlane = faceStore.plane(target); // Fragments lie on the plane of the original face
+    auto emit = [&](const Triangle &f, int side)
+    {
+        if (isSliver(f))
+        {
+            ++discardedFragments;
+        }
+        else
+        {
+            (side > 0 ? frontFaces : backFaces)->push_back(faceStore.addFace(f, material, object, facePlane));
+        }
+    };
+
+    if (sides[a] == 0) // Only the opposite edge is cut
+    {
+        ++twoPieceSplits;
+        vec3 position;
+        uint32_t i = cut(b, c, &position);
+        emit({v[a], v[b], i}, sides[b]);
+        emit({v[a], i, v[c]}, sides[c]);
+        return;
+    }
+
+    vec3 position1;
+    vec3 position2;
+    ++threePieceSplits[a];
+    uint32_t i1 = cut(a, b, &position1);
+    uint32_t i2 = cut(a, c, &position2);
+    emit({v[a], i1, i2}, sides[a]);
+
+    // The quadrilateral left on the other side is cut along its shorter diagonal
+    if (distance(position1, vec3(p[c])) <= distance(vec3(p[b]), position2))
+    {
+        emit({i1, v[b], v[c]}, sides[b]);
+        emit({i1, v[c], i2}, sides[b]);
+    }
+    else
+    {
+        emit({i1, v[b], i2}, sides[b]);
+        emit({i2, v[b], v[c]}, sides[b]);
+    }
+}
+
+Frustum getFrustum(const mat4x4 &projectionMat, const mat4x4 &transformMat)
+{
+    mat4x4 clip = projectionMat * transformMat;
+    vec4 rows[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        rows[i] = vec4(clip[0][i], clip[1][i], clip[2][i], clip[3][i]);
+    }
+
+    // -w <= x, y, z <= w in clip space
+    Frustum frustum;
+    for (int i = 0; i < 3; ++i)
+    {
+        frustum.planes[2 * i] = rows[3] + rows[i];
+        frustum.planes[2 * i + 1] = rows[3] - rows[i];
+    }
+    return frustum;
+}
+
+FrustumSide classifyBox(const Frustum &frustum, const vec3 &lowest, const vec3 &highest, uint32_t *planeMask)
+{
+    for (int i = 0; i < 6; ++i)
+    {
+        if (!(*planeMask & (1 << i)))
+        {
+            continue;
+        }
+
+        // The corners of the box farthest along and against the plane normal
+        const vec4 &plane = frustum.planes[i];
+        vec3 farthest(plane.x >= 0 ? highest.x : lowest.x, plane.y >= 0 ? highest.y : lowest.y, plane.z >= 0 ? highest.z : lowest.z);
+        vec3 nearest(plane.x >= 0 ? lowest.x : highest.x, plane.y >= 0 ? lowest.y : highest.y, plane.z >= 0 ? lowest.z : highest.z);
+        if (plane.x * farthest.x + plane.y * farthest.y + plane.z * farthest.z + plane.w < 0)
+        {
+            return OUTSIDE_FRUSTUM;
+        }
+        if (plane.x * nearest.x + plane.y * nearest.y + plane.z * nearest.z + plane.w >= 0)
+        {
+            *planeMask &= ~(1 << i); // Every subtree of the box is inside this plane too
+        }
+    }
+    return *planeMask == 0 ? INSIDE_FRUSTUM : CROSSING_FRUSTUM;
+}
+
 vec3 transformPoint(const mat4x4 &transformation, vec3 v) // Column major vs Row major...?
 {
     vec4 homogeneous(v.x, v.y, v.z, 1);
@@ -153,20 +1328,20 @@ vec3 transformVec(const mat4x4 &transformation, vec3 v) // Column major vs Row m
     return vec3(transformed.x, transformed.y, transformed.z);
 }
 
-int trianglePlaneIntersection(Face plane, Face triangle, vector<vec3> *outSegTips, vector<vec3> *outNormals)
+int trianglePlaneIntersection(const Plane &plane, const vec3 *vertices, const vec3 *normals, vector<vec3> *outSegTips, vector<vec3> *outNormals)
 {
-    vec3 N = getNormal(plane.v1, plane.v2, plane.v3);
-    float D = -(N.x * plane.v1.x + N.y * plane.v1.y + N.z * plane.v1.z);
+    vec3 N = plane.N;
+    float D = plane.D;
 
     int flag = 0;
     int prevSize = 0;
-    getSegmentPlaneIntersection(N, D, triangle.v1, triangle.v2, outSegTips, triangle.n1, triangle.n2, outNormals);
+    getSegmentPlaneIntersection(N, D, vertices[0], vertices[1], outSegTips, normals[0], normals[1], outNormals);
     flag |= (outSegTips->size() - prevSize > 0);
     prevSize = outSegTips->size();
-    getSegmentPlaneIntersection(N, D, triangle.v2, triangle.v3, outSegTips, triangle.n2, triangle.n3, outNormals);
+    getSegmentPlaneIntersection(N, D, vertices[1], vertices[2], outSegTips, normals[1], normals[2], outNormals);
     flag |= (outSegTips->size() - prevSize > 0) << 1;
     prevSize = outSegTips->size();
-    getSegmentPlaneIntersection(N, D, triangle.v3, triangle.v1, outSegTips, triangle.n3, triangle.n1, outNormals);
+    getSegmentPlaneIntersection(N, D, vertices[2], vertices[0], outSegTips, normals[2], normals[0], outNormals);
     flag |= (outSegTips->size() - prevSize > 0) << 2;
 
     return flag;
@@ -234,77 +1409,322 @@ vec3 getNormal(vec3 v1, vec3 v2, vec3 v3)
     return normalize(cross(v2 - v1, v3 - v1));
 }
 
-void BSPTree::draw(const mat4x4 &transformMat)
+void BSPTree::traverse(const vec3 &eye, TraversalOrder order, vector<uint32_t> *outFaces, const Frustum *frustum, FrameStats *outStats) const
 {
-    drawNode(root, transformMat);
-}
+    outFaces->clear();
+    if (root == NULL_INDEX)
+    {
+        emitPlacements(NULL_INDEX, false, order, outFaces); // Nothing to sort the dynamic objects against but each other
+        if (outStats != nullptr)
+        {
+            *outStats = FrameStats();
+            outStats->facesEmitted = outFaces->size();
+        }
+        return;
+    }
 
-void BSPTree::drawNode(Node *n, const mat4x4 &transformMat)
-{
-    Face f = n->face;
-    vec3 centroid = transformPoint(transformMat, (f.v1 + f.v2 + f.v3) / 3.0f);
-    vec3 faceNormal = transformVec(transformMat, getNormal(f.v1, f.v2, f.v3));
-    vec3 viewNormal = normalize(vec3(0, 0, 0) - centroid);
-    bool isFacingFront = dot(faceNormal, viewNormal) >= 0.0f;
+    // Entries are node indices shifted left by eight. The lowest bit tells whether to emit the node's face or to visit its subtree,
+    // and the next six which frustum planes the subtree may still cross.
+    const uint64_t EMIT = 1;
+    static thread_local vector<uint64_t> stack;
+    stack.clear();
+    stack.push_back((uint64_t) root << 8 | (frustum == nullptr ? 0 : ALL_FRUSTUM_PLANES << 1));
+    uint32_t visited = 0; // Counted whether or not outStats is given, which costs less than testing for it
+    uint32_t culled = 0;
 
-    if (isFacingFront)
+    while (!stack.empty())
     {
-        if (n->back != nullptr)
+        uint64_t entry = stack.back();
+        stack.pop_back();
+
+        uint32_t index = entry >> 8;
+        const Node &n = nodes[index];
+        if (entry & EMIT)
         {
-            drawNode(n->back, transformMat);
+            bool hasPlacements = !placements.empty() && index < placedNodes.size() && (placedNodes[index] & PLACED_HERE);
+            bool isNearFront = distFromPlane(n.plane.N, n.plane.D, eye) >= 0.0f; // Which side of this node is nearer
+            if (hasPlacements) // Dynamic objects on the earlier side come before the face
+            {
+                emitPlacements(index, isNearFront == (order == FRONT_TO_BACK), order, outFaces);
+            }
+            if (n.kind != SPLIT_NODE)
+            {
+                emitLeaf(n, eye, order, outFaces);
+            }
+            else
+            {
+                size_t firstEmitted = outFaces->size();
+                nodeFaces.forEachSpan(n.firstFace, n.faceCount, [&](const uint32_t *span, uint32_t length) // Empty once its faces were removed, but the plane still separates the subtrees
+                {
+                    outFaces->insert(outFaces->end(), span, span + length);
+                });
+                if (order == FRONT_TO_BACK) // Coplanar faces need no order, but this keeps both orders the reverse of each other
+                {
+                    reverse(outFaces->begin() + firstEmitted, outFaces->end());
+                }
+            }
+            if (hasPlacements)
+            {
+                emitPlacements(index, isNearFront != (order == FRONT_TO_BACK), order, outFaces);
+            }
+            continue;
         }
 
-        // Set the material
-        glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, f.diffuse);
-        glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, f.specular);
-        glMaterialfv(GL_FRONT_AND_BACK, GL_SHININESS, f.shininess);
-        glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, f.emission);
+        uint32_t planeMask = (entry >> 1) & ALL_FRUSTUM_PLANES;
+        if (planeMask != 0 && classifyBox(*frustum, n.lowest, n.highest, &planeMask) == OUTSIDE_FRUSTUM
+            && (placements.empty() || index >= placedNodes.size() || !(placedNodes[index] & ON_PLACEMENT_PATH))) // A dynamic object in the subtree may still be visible
+        {
+            ++culled;
+            continue; // Skipping a whole subtree leaves the order of the rest as it is
+        }
+        ++visited;
+        uint64_t childBits = planeMask << 1;
 
-        glBegin(GL_TRIANGLES);
-            glNormal3f(f.n1.x, f.n1.y, f.n1.z);
-            glVertex3f(f.v1.x, f.v1.y, f.v1.z);
+        bool isFacingFront = distFromPlane(n.plane.N, n.plane.D, eye) >= 0.0f; // The camera is in front of the plane
+        uint32_t first = isFacingFront ? n.back : n.front; // The subtree farther from the camera
+        uint32_t second = isFacingFront ? n.front : n.back;
+        if (order == FRONT_TO_BACK)
+        {
+            swap(first, second);
+        }
 
-            glNormal3f(f.n2.x, f.n2.y, f.n2.z);
-            glVertex3f(f.v2.x, f.v2.y, f.v2.z);
+        // Pushed in reverse so that they are popped as first, this node, second
+        if (second != NULL_INDEX)
+        {
+            stack.push_back((uint64_t) second << 8 | childBits);
+        }
+        stack.push_back((uint64_t) index << 8 | EMIT);
+        if (first != NULL_INDEX)
+        {
+            stack.push_back((uint64_t) first << 8 | childBits);
+        }
+    }
 
-            glNormal3f(f.n3.x, f.n3.y, f.n3.z);
-            glVertex3f(f.v3.x, f.v3.y, f.v3.z);
-        glEnd();
+    if (outStats != nullptr)
+    {
+        outStats->nodesVisited = visited;
+        outStats->nodesCulled = culled;
+        outStats->facesEmitted = outFaces->size();
+    }
+}
 
-        if (n->front != nullptr)
+// A ray through a convex leaf leaves through a face turned away from the camera after entering through one facing it, so those turned away are drawn first.
+// Through a concave leaf it is the other way around.
+void BSPTree::emitLeaf(const Node &leaf, const vec3 &eye, TraversalOrder order, vector<uint32_t> *outFaces) const
+{
+    size_t firstEmitted = outFaces->size();
+    bool isFacingFirst = leaf.kind == CONCAVE_LEAF;
+    for (bool isFacing : {isFacingFirst, !isFacingFirst})
+    {
+        for (uint32_t k = 0; k < leaf.faceCount; ++k)
         {
-            drawNode(n->front, transformMat);
+            uint32_t f = nodeFaces[leaf.firstFace + k];
+            const Plane &plane = faceStore.plane(f);
+            if ((distFromPlane(plane.N, plane.D, eye) >= 0.0f) == isFacing)
+            {
+                outFaces->push_back(f);
+            }
         }
     }
-    else
+    if (order == FRONT_TO_BACK)
+    {
+        reverse(outFaces->begin() + firstEmitted, outFaces->end());
+    }
+}
+
+void BSPTree::draw(const mat4x4 &transformMat)
+{
+    GLfloat projectionArr[16];
+    glGetFloatv(GL_PROJECTION_MATRIX, projectionArr);
+    draw(transformMat, make_mat4x4(projectionArr));
+}
+
+void BSPTree::draw(const mat4x4 &transformMat, const mat4x4 &projectionMat)
+{
+    vec4 eye = inverse(transformMat) * vec4(0, 0, 0, 1); // The camera in world coordinates
+    Frustum frustum = getFrustum(projectionMat, transformMat);
+    placeDynamicObjects(vec3(eye.x, eye.y, eye.z));
+    FrameStats *stats = nullptr;
+    if (collectFrameStats)
+    {
+        frameStats = FrameStats();
+        stats = &frameStats;
+    }
+    int issuedBefore = materials->getIssuedCount(); // The table counts the whole frame, which may hold other draws
+    traverse(vec3(eye.x, eye.y, eye.z), BACK_TO_FRONT, &drawOrder, &frustum, stats);
+
+    if (opaquePass)
+    {
+        glPushAttrib(GL_ENABLE_BIT | GL_DEPTH_BUFFER_BIT); // Restored after the tree
+        // Opaque faces hide each other through the depth buffer in any order. The faces of the tree are then only tested against them,
+        // so that they are hidden behind opaque faces but blend with each other in the order of the tree.
+        glEnable(GL_DEPTH_TEST);
+        glDepthMask(GL_TRUE);
+        renderer.draw(faceStore, opaqueFaces, materials);
+        glDepthMask(GL_FALSE);
+    }
+
+    // Static faces between two dynamic objects are drawn in one go
+    size_t first = 0;
+    for (size_t i = 0; i <= drawOrder.size(); ++i)
     {
-        if (n->front != nullptr)
+        if (i < drawOrder.size() && !(drawOrder[i] & DYNAMIC_OBJECT_FLAG))
         {
-            drawNode(n->front, transformMat);
+            continue;
         }
 
-        // Set the material
-        glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, f.diffuse);
-        glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, f.specular);
-        glMaterialfv(GL_FRONT_AND_BACK, GL_SHININESS, f.shininess);
-        glMaterialfv(GL_FRONT_AND_BACK, GL_EMISSION, f.emission);
+        renderer.draw(faceStore, drawOrder.data() + first, i - first, materials);
+        if (i < drawOrder.size())
+        {
+            const DynamicObject &object = dynamicObjects[drawOrder[i] & ~DYNAMIC_OBJECT_FLAG];
+            glPushMatrix();
+            glMultMatrixf(value_ptr(object.transformation));
+            object.tree->draw(transformMat * object.transformation, projectionMat); // Sorts and culls its own faces in its coordinates
+            glPopMatrix();
+        }
+        first = i + 1;
+    }
+
+    if (opaquePass)
+    {
+        glPopAttrib();
+    }
+    if (stats != nullptr)
+    {
+        stats->materialChanges = materials->getIssuedCount() - issuedBefore;
+    }
+}
+
+void BSPTree::getBounds(vec3 *outCenter, float *outRadius) const
+{
+    uint32_t count = faceStore.getVertexCount();
+    if (count == 0)
+    {
+        *outCenter = vec3(0, 0, 0);
+        *outRadius = 0;
+        return;
+    }
+
+    vec3 lowest = faceStore.position(0);
+    vec3 highest = lowest;
+    for (uint32_t v = 1; v < count; ++v)
+    {
+        lowest = min(lowest, faceStore.position(v));
+        highest = max(highest, faceStore.position(v));
+    }
+
+    vec3 center = (lowest + highest) * 0.5f;
+    float radius = 0;
+    for (uint32_t v = 0; v < count; ++v)
+    {
+        radius = max(radius, distance(center, faceStore.position(v)));
+    }
+    *outCenter = center;
+    *outRadius = radius;
+}
+
+uint32_t BSPTree::addDynamicObject(BSPTree *object, const mat4x4 &transformation)
+{
+    DynamicObject added;
+    added.tree = object;
+    added.transformation = transformation;
+    object->getBounds(&added.center, &added.radius);
+    dynamicObjects.push_back(added);
+    placeDynamicObjects(placementEye);
+    return dynamicObjects.size() - 1;
+}
+
+void BSPTree::moveDynamicObject(uint32_t handle, const mat4x4 &transformation)
+{
+    dynamicObjects[handle].transformation = transformation; // Placed again in the next draw; the trees stay as they are
+}
+
+void BSPTree::removeDynamicObject(uint32_t handle)
+{
+    dynamicObjects[handle].tree = nullptr; // Keeps the other handles valid
+    placeDynamicObjects(placementEye);
+}
+
+// Find for every dynamic object the empty subtree of the static tree it falls into
+void BSPTree::placeDynamicObjects(const vec3 &eye)
+{
+    for (uint32_t node : placementPath)
+    {
+        placedNodes[node] = 0;
+    }
+    placementPath.clear();
+    placements.clear();
+    placedNodes.resize(nodes.size(), 0);
+    placementEye = eye;
 
-        Face f = n->face;
-        glBegin(GL_TRIANGLES);
-            glNormal3f(f.n1.x, f.n1.y, f.n1.z);
-            glVertex3f(f.v1.x, f.v1.y, f.v1.z);
+    for (uint32_t i = 0; i < dynamicObjects.size(); ++i)
+    {
+        const DynamicObject &object = dynamicObjects[i];
+        if (object.tree == nullptr)
+        {
+            continue;
+        }
 
-            glNormal3f(f.n2.x, f.n2.y, f.n2.z);
-            glVertex3f(f.v2.x, f.v2.y, f.v2.z);
+        // Follow the center of the bounding sphere down to an empty subtree.
+        // Where the sphere straddles a plane, no order is right for both halves, and the side of the center is the better guess.
+        vec3 center = transformPoint(object.transformation, object.center);
+        Placement placement = {NULL_INDEX, false, distance(eye, center), i};
+        uint32_t node = root;
+        while (node != NULL_INDEX)
+        {
+            const Node &n = nodes[node];
+            placement.node = node;
+            placement.isFront = distFromPlane(n.plane.N, n.plane.D, center) >= 0.0f;
+            placedNodes[node] |= ON_PLACEMENT_PATH;
+            placementPath.push_back(node);
+            node = placement.isFront ? n.front : n.back;
+        }
 
-            glNormal3f(f.n3.x, f.n3.y, f.n3.z);
-            glVertex3f(f.v3.x, f.v3.y, f.v3.z);
-        glEnd();
+        placements.push_back(placement);
+        if (placement.node != NULL_INDEX)
+        {
+            placedNodes[placement.node] |= PLACED_HERE;
+        }
+    }
 
-        if (n->back != nullptr)
+    sort(placements.begin(), placements.end(), [](const Placement &a, const Placement &b)
+    {
+        if (a.node != b.node)
+        {
+            return a.node < b.node;
+        }
+        if (a.isFront != b.isFront)
         {
-            drawNode(n->back, transformMat);
+            return a.isFront < b.isFront;
         }
+        return a.distance > b.distance; // Farther first
+    });
+}
+
+void BSPTree::emitPlacements(uint32_t node, bool isFront, TraversalOrder order, vector<uint32_t> *outFaces) const
+{
+    auto first = lower_bound(placements.begin(), placements.end(), make_pair(node, isFront), [](const Placement &p, const pair<uint32_t, bool> &key)
+    {
+        return p.node < key.first || (p.node == key.first && p.isFront < key.second);
+    });
+    auto last = first;
+    while (last != placements.end() && last->node == node && last->isFront == isFront)
+    {
+        ++last;
     }
 
-}
\ No newline at end of file
+    if (order == BACK_TO_FRONT)
+    {
+        for (auto p = first; p != last; ++p)
+        {
+            outFaces->push_back(p->object | DYNAMIC_OBJECT_FLAG);
+        }
+    }
+    else
+    {
+        for (auto p = last; p != first; --p)
+        {
+            outFaces->push_back((p - 1)->object | DYNAMIC_OBJECT_FLAG);
+        }
+    }
+}
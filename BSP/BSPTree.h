@@ -1,9 +1,21 @@
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <string>
+#include <memory>
+#include <unordered_map>
+#include <atomic>
 #include <GL/gl.h>
 #include <glm/glm.hpp>
 #include "Face.h"
+#include "FaceStore.h"
+#include "Simd.h"
+#include "FaceRenderer.h"
+#include "Material.h"
+#include "TaskPool.h"
+#include "Arena.h"
+#include "MappedFile.h"
+#include "objImporter.h"
 using namespace std;
 using namespace glm;
 
@@ -13,36 +25,237 @@ const float eps3 = 0.0f;
 
 vec3 transformPoint(const mat4x4 &transformation, vec3 v);
 vec3 transformVec(const mat4x4 &transformation, vec3 v);
-int trianglePlaneIntersection(Face plane, Face triangle, vector<vec3> *outSegTips, vector<vec3> *outNormals);
+int trianglePlaneIntersection(const Plane &plane, const vec3 *vertices, const vec3 *normals, vector<vec3> *outSegTips, vector<vec3> *outNormals);
 void getSegmentPlaneIntersection(vec3 N, float D, vec3 p1, vec3 p2, vector<vec3> *outSegTips, vec3 n1, vec3 n2, vector<vec3> *outNormals);
 float distFromPlane(vec3 N, float D, vec3 p);
 bool insertIfNotIn(vector<vec3> *v, vec3 x);
 vec3 getNormal(vec3 v1, vec3 v2, vec3 v3);
 
 class BSPTree;
-class Node;
+
+// How the faces of a node are ordered against each other
+enum NodeKind
+{
+    SPLIT_NODE, // The faces lie in the plane, which separates the subtrees
+    CONVEX_LEAF, // Every face lies behind the planes of the others, like the surface of a convex solid seen from outside
+    CONCAVE_LEAF // Every face lies in front of the planes of the others, like the walls of a convex room seen from inside
+};
+
+struct Node
+{
+    uint32_t firstFace = 0; // Span of BSPTree::nodeFaces holding the splitter and the faces coplanar with it
+    uint32_t faceCount = 0;
+    Plane plane; // Plane of the splitter, cached for the traversal
+    uint32_t back = NULL_INDEX; // Left child
+    uint32_t front = NULL_INDEX; // Right child
+    vec3 lowest; // Bounding box of the faces of the whole subtree
+    vec3 highest;
+    uint32_t kind = SPLIT_NODE; // A leaf has no subtrees, and its plane is only that of its first face
+};
+
+// Planes of a view frustum in world coordinates; a point p is inside when dot(plane, vec4(p, 1)) >= 0 for all six
+struct Frustum
+{
+    vec4 planes[6];
+};
+
+enum FrustumSide
+{
+    OUTSIDE_FRUSTUM,
+    INSIDE_FRUSTUM,
+    CROSSING_FRUSTUM
+};
+
+Frustum getFrustum(const mat4x4 &projectionMat, const mat4x4 &transformMat);
+FrustumSide classifyBox(const Frustum &frustum, const vec3 &lowest, const vec3 &highest, uint32_t *planeMask); // Tests the planes whose bits are set and clears those the box is inside of
+
+const char TREE_FILE_MAGIC[4] = {'B', 'S', 'P', 'T'};
+const uint32_t TREE_FILE_VERSION = 5;
+
+// Laid out at the start of a saved tree, followed by the nodes, their face spans and the face store columns, each starting on a 64-byte boundary
+struct TreeFileHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t sceneHash; // Of the inserted faces and the build settings
+    uint32_t root;
+    uint32_t nodeCount;
+    uint32_t nodeFaceCount;
+    uint32_t vertexCount;
+    uint32_t faceCount;
+};
+
+enum SplitterPolicy
+{
+    FIRST_FACE, // Always partition with the first face
+    RANDOM_SAMPLE, // The face causing the fewest splits among sampleSize candidates drawn at random
+    LEAST_SPLITS, // The face causing the fewest splits among sampleSize candidates evenly strided through the faces; all of them when sampleSize is 0
+    BALANCED // The face with the best weighted score of splits and front/back imbalance among the same strided candidates
+};
+
+const float ROBUST_TOLERANCE = 1e-5f; // Plane tolerance of robust splitting relative to the largest coordinate of the scene
+
+// What the last build did, for tuning the splitter settings
+struct BuildStats
+{
+    uint32_t inputFaces = 0; // Faces the tree was built from; those of the opaque pass are not counted
+    uint32_t outputFaces = 0; // Faces held by the nodes
+    uint32_t fragments = 0; // Faces added to the store by splitting
+    uint32_t threePieceSplits[3] = {0, 0, 0}; // By the corner alone on its side: v1 (flag 5), v2 (flag 3) and v3 (flag 6)
+    uint32_t twoPieceSplits = 0; // Cut through a corner lying on the plane; robust splitting only
+    uint32_t discardedFragments = 0; // Degenerate pieces, or slivers with robust splitting
+    uint32_t nodeCount = 0;
+    uint32_t leafCount = 0; // Nodes without subtrees
+    uint32_t maxDepth = 0; // In nodes; the root alone has depth 1
+    float averageDepth = 0.0f; // Of the leaves
+    float balance = 0.0f; // Mean ratio of the smaller to the larger subtree, in nodes, over nodes with both; 1 is perfectly balanced
+    size_t bytes = 0; // Held by the tree after the build
+    size_t peakBytes = 0; // Held during the build; see getPeakMemory
+    double prepareMs = 0.0; // Dropping the old tree and separating the opaque faces
+    double partitionMs = 0.0; // Building the nodes
+    double splitterMs = 0.0; // Part of partitionMs spent choosing splitters, summed over the build threads
+    double finishMs = 0.0; // Bounding boxes and these statistics
+};
+
+// What the traversal of the last frame did; collected once enabled with setFrameStats
+struct FrameStats
+{
+    uint32_t nodesVisited = 0;
+    uint32_t nodesCulled = 0; // Subtrees skipped outside the frustum
+    uint32_t facesEmitted = 0; // Entries of the traversal, dynamic objects included
+    uint32_t materialChanges = 0; // glMaterialfv calls the draw issued, dynamic objects included; properties already set are skipped and not counted
+};
+
+const uint32_t DYNAMIC_OBJECT_FLAG = 0x80000000; // Marks entries of a traversal that are dynamic objects rather than faces
+
+// A separately built tree drawn inside another tree under a transformation that may change every frame
+struct DynamicObject
+{
+    BSPTree *tree; // In its own coordinates; owned by the caller
+    mat4x4 transformation;
+    vec3 center; // Bounding sphere in the object's coordinates
+    float radius;
+};
+
+// Where a dynamic object falls in the static tree for the current frame
+struct Placement
+{
+    uint32_t node; // The last node before the empty subtree the object falls into
+    bool isFront; // The side of that node the empty subtree is on
+    float distance; // From the camera to the center of the sphere
+    uint32_t object;
+};
+
+enum TraversalOrder
+{
+    BACK_TO_FRONT, // Farthest face first; the order for blending
+    FRONT_TO_BACK // Nearest face first; the order for picking
+};
 
 class BSPTree
 {
     public:
-        void insertFaces(vector<Face> object, mat4x4 transformation, GLfloat *diffuse, GLfloat *specular, GLfloat *shininess, GLfloat *emission);
+        BSPTree(MaterialTable *materials, SplitterPolicy policy = FIRST_FACE, int sampleSize = 16, float splitWeight = 0.8f);
+
+        // Both return an object id. Once the tree is built, the new faces are pushed down into it instead of waiting for the next build.
+        uint32_t insertFaces(const vector<Face> &object, const mat4x4 &transformation, uint16_t material);
+        uint32_t insertMesh(const Mesh &mesh, const mat4x4 &transformation, uint16_t material); // Shares the vertices of the mesh between its faces
+        void removeObject(uint32_t object); // Drops every face and fragment of the object; the tree stays built
+        void setBuildThreads(int threadCount, int parallelCutoff = 1024); // Same planes and faces in the same order as the serial build, but node and fragment indices depend on the threads
+        void setOpaquePass(bool enabled); // Keeps opaque faces out of the tree and draws them first with the depth test; applies from the next build
+        void setRobustSplitting(bool enabled); // Scale-relative tolerances and splits that leave no slivers; applies from the next build
+        void setLeafSize(int maxFaces); // Stop splitting cells of at most maxFaces faces forming a convex set; 0 splits down to coplanar faces
+        void setMemoryBudget(size_t bytes); // Once a build holds more, the rest of the tree is built with LEAST_SPLITS; 0 for no budget. With several build threads, where it switches depends on their timing.
+        size_t getPeakMemory() const; // Estimated bytes the last build held at most
+        Face getFace(uint32_t face) const; // An expanded copy of a face of a traversal
+        const BuildStats &getBuildStats() const; // Of the last build; zero after a load
+        void setFrameStats(bool enabled);
+        const FrameStats &getFrameStats() const; // Of the last draw
         void build();
-        void classify(Face root, Face target, vector<Face> *frontFaces, vector<Face> *backFaces);
-        void draw(const mat4x4 &transformMat);
+        bool save(const string &path) const;
+        bool load(const string &path); // False unless the file holds a valid tree built from the same faces and settings
+        void classify(uint32_t root, uint32_t target, vector<uint32_t> *frontFaces, vector<uint32_t> *backFaces);
+        // Faces of the tree in depth order as seen from eye; includes the dynamic objects where draw, or the last change to the tree, placed them. Subtrees outside frustum are skipped.
+        void traverse(const vec3 &eye, TraversalOrder order, vector<uint32_t> *outFaces, const Frustum *frustum = nullptr, FrameStats *outStats = nullptr) const;
+        void draw(const mat4x4 &transformMat, const mat4x4 &projectionMat);
+        void draw(const mat4x4 &transformMat); // Takes the projection from GL
+        void getBounds(vec3 *outCenter, float *outRadius) const; // A sphere around every vertex
+
+        uint32_t addDynamicObject(BSPTree *object, const mat4x4 &transformation); // object must be built; returns a handle
+        void moveDynamicObject(uint32_t handle, const mat4x4 &transformation);
+        void removeDynamicObject(uint32_t handle);
     
     private:
-        vector<Face> faces;
-        vector<Face> frontFaces;
-        vector<Face> backFaces;
-        Node *root;
+        MaterialTable *materials; // Shared by every tree of the scene
+        FaceStore faceStore;
+        vector<uint32_t> faces; // Inserted faces the tree is built from, in ascending order; build moves them to the front of the store
+        Arena<Node> nodes;
+        Arena<uint32_t> nodeFaces; // Face spans of the nodes; faces of a span are grouped by material
+        uint32_t root = NULL_INDEX;
+        bool isBuilt = false;
+        uint32_t objectCount = 0;
+        bool opaquePass = false;
+        bool robustSplitting = false;
+        float planeTolerance = eps1; // Corners closer to a splitting plane count as lying on it
+        int leafSize = 0;
+        size_t memoryBudget = 0;
+        atomic<size_t> peakMemory{0};
+        atomic<size_t> workMemory{0}; // Bytes of the work buffers faces are partitioned in
+        atomic<bool> isOverBudget{false};
+        BuildStats buildStats;
+        atomic<uint32_t> threePieceSplits[3] = {}; // Counted while building and copied into buildStats
+        atomic<uint32_t> twoPieceSplits{0};
+        atomic<uint32_t> discardedFragments{0};
+        atomic<int64_t> splitterNanoseconds{0};
+        bool collectFrameStats = false;
+        FrameStats frameStats;
+        vector<uint32_t> opaqueFaces; // Kept out of the tree when opaquePass is set; sorted by material
 
-        Node *makeNode(const vector<Face> &facesToClassify);
-        void drawNode(Node *n, const mat4x4 &transformMat);
-};
+        SplitterPolicy splitterPolicy;
+        int sampleSize; // Number of candidates scored per node; 0 scores every face
+        float splitWeight; // Weight of splits against imbalance for BALANCED
 
-struct Node
-{
-    Face face;
-    Node *back; // Left child
-    Node *front; // Right child
-};
\ No newline at end of file
+        int buildThreads = 1; // 1 builds serially; 0 uses every hardware core
+        size_t parallelCutoff = 1024; // Subtrees with fewer faces are built by the thread that classified them
+        TaskPool *pool = nullptr;
+
+        uint32_t makeNode(const vector<uint32_t> &facesToClassify);
+        uint32_t makeNode(vector<uint32_t> *work, size_t begin, uint32_t leafTestSize); // Only cells of at most leafTestSize faces are tested for a leaf
+        void setNodeFaces(Node *node, vector<uint32_t> *faceIds);
+        NodeKind getLeafKind(const uint32_t *faceIds, uint32_t count) const; // SPLIT_NODE when the faces do not form a convex set
+        void emitLeaf(const Node &leaf, const vec3 &eye, TraversalOrder order, vector<uint32_t> *outFaces) const;
+        uint32_t pushDown(uint32_t index, const vector<uint32_t> &facesToPush);
+        void partition(const Plane &plane, const vector<uint32_t> &facesToClassify, const TriangleCoords &coords, int splitter, vector<uint32_t> *frontFaces, vector<uint32_t> *backFaces, vector<uint32_t> *coplanarFaces = nullptr);
+        void classify(const Plane &plane, uint32_t target, vector<uint32_t> *frontFaces, vector<uint32_t> *backFaces);
+        void splitRobustly(const Plane &plane, uint32_t target, vector<uint32_t> *frontFaces, vector<uint32_t> *backFaces);
+        void classifySides(const Plane &plane, const TriangleCoords &coords, uint8_t *outSides) const;
+        void updateTolerance();
+        uint32_t finishInsert(size_t firstFace);
+        void separateOpaqueFaces(const vector<uint32_t> &facesToSort, vector<uint32_t> *outTranslucentFaces);
+        void ownTree();
+        void updateBounds();
+        void compactTree(); // After nodes were cut off or rebuilt in place of others
+        bool isDegenerate(const Triangle &t) const;
+        bool isSliver(const Triangle &t) const; // Thinner than planeTolerance
+        void gatherTriangles(const uint32_t *faceIds, int count, TriangleCoords *outCoords) const;
+        int chooseSplitter(const uint32_t *faceIds, const TriangleCoords &coords);
+        float scoreSplitter(const uint32_t *faceIds, const TriangleCoords &coords, int candidate, SplitterPolicy policy, uint8_t *sides);
+        size_t getTreeMemory() const; // Bytes of the nodes and the face store
+        void appendWork(vector<uint32_t> *work, vector<uint32_t> *pieces);
+        void trackMemory(size_t temporaryBytes);
+        void updateBuildStats(); // The shape of the tree and the counters of the build
+        vector<uint32_t> drawOrder; // Reused every frame
+        FaceRenderer renderer;
+        unique_ptr<MappedFile> treeFile; // Backs the nodes and faces after load until the next build
+
+        vector<DynamicObject> dynamicObjects; // Removed ones have no tree
+        vector<Placement> placements; // Sorted by node, side and distance; refreshed by draw and whenever the nodes change
+        vector<uint8_t> placedNodes; // Per node; PLACED_HERE and ON_PLACEMENT_PATH bits
+        vector<uint32_t> placementPath; // Nodes whose bits are set
+        vec3 placementEye = vec3(0.0f); // Where the objects were last placed from
+
+        void placeDynamicObjects(const vec3 &eye);
+        void emitPlacements(uint32_t node, bool isFront, TraversalOrder order, vector<uint32_t> *outFaces) const;
+
+        uint64_t getSceneHash() const;
+};
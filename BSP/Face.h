@@ -9,10 +9,9 @@ struct Face
 {
     Face() {}
 
-    Face(vec3 _v1, vec3 _v2, vec3 _v3, vec3 _n1, vec3 _n2, vec3 _n3, GLfloat *_diffuse, GLfloat *_specular, GLfloat *_shininess, GLfloat *_emission)
+    Face(vec3 _v1, vec3 _v2, vec3 _v3, vec3 _n1, vec3 _n2, vec3 _n3)
     : v1(_v1), v2(_v2), v3(_v3), 
-    n1(_n1), n2(_n2), n3(_n3),
-    diffuse(_diffuse), specular(_specular), shininess(_shininess), emission(_emission) 
+    n1(_n1), n2(_n2), n3(_n3)
     {}
     
     // Vertices
@@ -24,12 +23,6 @@ struct Face
     vec3 n1; 
     vec3 n2;
     vec3 n3;
-
-    // Elements
-    GLfloat *diffuse = nullptr;
-    GLfloat *specular = nullptr;
-    GLfloat *shininess = nullptr;
-    GLfloat *emission = nullptr;
 };
 
 #endif
\ No newline at end of file
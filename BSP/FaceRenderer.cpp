@@ -0,0 +1,108 @@
+#define GL_GLEXT_PROTOTYPES // Buffer objects are declared as extensions by the Linux GL headers
+#include "FaceRenderer.h"
+
+FaceRenderer::~FaceRenderer()
+{
+    if (positionBuffer != 0) // Never created without a GL context, so a renderer that never drew needs none here
+    {
+        GLuint buffers[] = {positionBuffer, normalBuffer, indexBuffer};
+        glDeleteBuffers(3, buffers);
+    }
+}
+
+void FaceRenderer::upload(const FaceStore &faceStore)
+{
+    if (positionBuffer == 0)
+    {
+        glGenBuffers(1, &positionBuffer);
+        glGenBuffers(1, &normalBuffer);
+        glGenBuffers(1, &indexBuffer);
+    }
+
+    uint32_t vertexCount = faceStore.getVertexCount();
+    vector<vec3> positions(vertexCount);
+    vector<vec3> normals(vertexCount);
+    for (uint32_t v = 0; v < vertexCount; ++v) // The pools are chunked, so gather them into one array first
+    {
+        positions[v] = faceStore.position(v);
+        normals[v] = faceStore.normal(v);
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, positionBuffer);
+    glBufferData(GL_ARRAY_BUFFER, vertexCount * sizeof(vec3), positions.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, normalBuffer);
+    glBufferData(GL_ARRAY_BUFFER, vertexCount * sizeof(vec3), normals.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    uploaded = true;
+}
+
+void FaceRenderer::draw(const FaceStore &faceStore, const vector<uint32_t> &faces, MaterialTable *materials)
+{
+    draw(faceStore, faces.data(), faces.size(), materials);
+}
+
+void FaceRenderer::draw(const FaceStore &faceStore, const uint32_t *faces, size_t count, MaterialTable *materials)
+{
+    if (!uploaded)
+    {
+        upload(faceStore);
+    }
+
+    // Build the index stream and cut it into runs of one material
+    indices.clear();
+    runs.clear();
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint32_t face = faces[i];
+        uint16_t material = faceStore.materialId(face);
+        if (runs.empty() || runs.back().material != material)
+        {
+            runs.push_back({material, (uint32_t) indices.size(), 0});
+        }
+
+        const Triangle &t = faceStore.triangle(face);
+        indices.push_back(t.v1);
+        indices.push_back(t.v2);
+        indices.push_back(t.v3);
+        runs.back().count += 3;
+    }
+
+    if (indices.empty())
+    {
+        return;
+    }
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), nullptr, GL_STREAM_DRAW); // Orphan last frame's indices
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, indices.size() * sizeof(GLuint), indices.data());
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, positionBuffer);
+    glVertexPointer(3, GL_FLOAT, 0, nullptr);
+    glBindBuffer(GL_ARRAY_BUFFER, normalBuffer);
+    glNormalPointer(GL_FLOAT, 0, nullptr);
+
+    for (const Run &run : runs)
+    {
+        materials->bind(run.material); // Only the properties differing from the previous run are set
+
+        glDrawElements(GL_TRIANGLES, run.count, GL_UNSIGNED_INT, (const GLvoid *) (run.first * sizeof(GLuint)));
+    }
+
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+bool FaceRenderer::isUploaded() const
+{
+    return uploaded;
+}
+
+void FaceRenderer::invalidate()
+{
+    uploaded = false;
+}
@@ -0,0 +1,44 @@
+#ifndef FACE_RENDERER
+#define FACE_RENDERER
+
+#include <vector>
+#include <cstdint>
+#include <GL/gl.h>
+#include "FaceStore.h"
+#include "Material.h"
+using namespace std;
+
+// Draws faces of a face store from vertex buffer objects.
+// The vertex pools are uploaded once; each frame only the indices of the faces to draw are streamed, and consecutive faces sharing a material are drawn with one call.
+class FaceRenderer
+{
+    public:
+        FaceRenderer() = default;
+        FaceRenderer(const FaceRenderer &) = delete; // Two copies would delete the same buffers
+        FaceRenderer &operator=(const FaceRenderer &) = delete;
+        ~FaceRenderer(); // Deletes the buffers, if any were uploaded
+
+        void upload(const FaceStore &faceStore); // Needs a current GL context; call again after the store has changed
+        void draw(const FaceStore &faceStore, const vector<uint32_t> &faces, MaterialTable *materials);
+        void draw(const FaceStore &faceStore, const uint32_t *faces, size_t count, MaterialTable *materials);
+        bool isUploaded() const;
+        void invalidate(); // The next draw uploads the store again
+
+    private:
+        struct Run
+        {
+            uint16_t material;
+            uint32_t first; // Offset into indices
+            uint32_t count;
+        };
+
+        GLuint positionBuffer = 0; // Created once and refilled by later uploads
+        GLuint normalBuffer = 0;
+        GLuint indexBuffer = 0;
+        bool uploaded = false;
+
+        vector<GLuint> indices; // Reused every frame
+        vector<Run> runs;
+};
+
+#endif
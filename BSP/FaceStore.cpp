@@ -0,0 +1,151 @@
+#include "FaceStore.h"
+
+uint32_t FaceStore::addVertex(const vec3 &position, const vec3 &normal)
+{
+    uint32_t v = positions.allocate();
+    normals.reserve(v, 1);
+
+    positions[v] = position;
+    normals[v] = normal;
+
+    return v;
+}
+
+uint32_t FaceStore::addVertices(const vec3 *positions, const vec3 *normals, uint32_t count)
+{
+    if (count == 0)
+    {
+        return this->positions.size();
+    }
+
+    uint32_t first = this->positions.allocate(count);
+    this->normals.reserve(first, count);
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        this->positions[first + i] = positions[i];
+        this->normals[first + i] = normals[i];
+    }
+
+    return first;
+}
+
+uint32_t FaceStore::addFace(const Triangle &triangle, uint16_t material, uint32_t object)
+{
+    const vec3 &p1 = positions[triangle.v1];
+    const vec3 &p2 = positions[triangle.v2];
+    const vec3 &p3 = positions[triangle.v3];
+
+    Plane plane;
+    plane.N = normalize(cross(p2 - p1, p3 - p1));
+    plane.D = -dot(plane.N, p1);
+
+    return addFace(triangle, material, object, plane);
+}
+
+uint32_t FaceStore::addFace(const Triangle &triangle, uint16_t material, uint32_t object, const Plane &plane)
+{
+    uint32_t f = triangles.allocate();
+    planes.reserve(f, 1);
+    materialIds.reserve(f, 1);
+    objectIds.reserve(f, 1);
+
+    triangles[f] = triangle;
+    planes[f] = plane;
+    materialIds[f] = material;
+    objectIds[f] = object;
+
+    return f;
+}
+
+void FaceStore::truncate(uint32_t vertexCount, uint32_t faceCount)
+{
+    positions.truncate(vertexCount);
+    normals.truncate(vertexCount); // Only counted while viewed
+    triangles.truncate(faceCount);
+    planes.truncate(faceCount);
+    materialIds.truncate(faceCount);
+    objectIds.truncate(faceCount);
+}
+
+void FaceStore::compact(vector<uint32_t> *faces)
+{
+    // Kept vertices and faces only move down, so both are renumbered in place in ascending order
+    vector<uint32_t> vertexIds(getVertexCount(), NULL_INDEX);
+    for (uint32_t f : *faces)
+    {
+        const Triangle &t = triangles[f];
+        vertexIds[t.v1] = vertexIds[t.v2] = vertexIds[t.v3] = 0;
+    }
+    uint32_t vertexCount = 0;
+    for (uint32_t v = 0; v < vertexIds.size(); ++v)
+    {
+        if (vertexIds[v] != NULL_INDEX)
+        {
+            positions[vertexCount] = positions[v];
+            normals[vertexCount] = normals[v];
+            vertexIds[v] = vertexCount++;
+        }
+    }
+
+    for (uint32_t i = 0; i < faces->size(); ++i)
+    {
+        uint32_t f = (*faces)[i];
+        Triangle t = triangles[f];
+        triangles[i] = {vertexIds[t.v1], vertexIds[t.v2], vertexIds[t.v3]};
+        planes[i] = planes[f];
+        materialIds[i] = materialIds[f];
+        objectIds[i] = objectIds[f];
+        (*faces)[i] = i;
+    }
+    truncate(vertexCount, faces->size());
+}
+
+void FaceStore::clear()
+{
+    positions.clear();
+    normals.clear();
+    triangles.clear();
+    planes.clear();
+    materialIds.clear();
+    objectIds.clear();
+}
+
+void FaceStore::view(const vec3 *positions, const vec3 *normals, uint32_t vertexCount,
+    const Triangle *triangles, const Plane *planes, const uint16_t *materialIds, const uint32_t *objectIds, uint32_t faceCount)
+{
+    this->positions.view(positions, vertexCount);
+    this->normals.view(normals, vertexCount);
+    this->triangles.view(triangles, faceCount);
+    this->planes.view(planes, faceCount);
+    this->materialIds.view(materialIds, faceCount);
+    this->objectIds.view(objectIds, faceCount);
+}
+
+void FaceStore::own()
+{
+    positions.own();
+    normals.own();
+    triangles.own();
+    planes.own();
+    materialIds.own();
+    objectIds.own();
+}
+
+uint32_t FaceStore::getVertexCount() const
+{
+    return positions.size();
+}
+
+uint32_t FaceStore::getFaceCount() const
+{
+    return triangles.size();
+}
+
+Face FaceStore::getFace(uint32_t f) const
+{
+    const Triangle &t = triangles[f];
+
+    return Face(positions[t.v1], positions[t.v2], positions[t.v3],
+        normals[t.v1], normals[t.v2], normals[t.v3]);
+}
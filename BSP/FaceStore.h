@@ -0,0 +1,73 @@
+#ifndef FACE_STORE
+#define FACE_STORE
+
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include "Face.h"
+#include "Arena.h"
+using namespace std;
+using namespace glm;
+
+struct Plane
+{
+    vec3 N; // Unit normal
+    float D; // dot(N, p) + D == 0 for every point p on the plane
+};
+
+struct Triangle
+{
+    uint32_t v1; // Indices into the vertex pools
+    uint32_t v2;
+    uint32_t v3;
+};
+
+// Faces of the BSP tree stored as columns.
+// Vertices are shared between faces through indices, and each face keeps its plane, a material id and an object id instead of a copy of every property.
+// Adding vertices and faces is thread-safe, and indices stay valid while other threads add more.
+class FaceStore
+{
+    public:
+        uint32_t addVertex(const vec3 &position, const vec3 &normal);
+        uint32_t addVertices(const vec3 *positions, const vec3 *normals, uint32_t count); // Returns the first of count consecutive vertices
+        uint32_t addFace(const Triangle &triangle, uint16_t material, uint32_t object); // Computes the plane of the face
+        uint32_t addFace(const Triangle &triangle, uint16_t material, uint32_t object, const Plane &plane); // For fragments lying on a known plane
+        void truncate(uint32_t vertexCount, uint32_t faceCount); // Not thread-safe; drops what was added after the given counts
+        void compact(vector<uint32_t> *faces); // Not thread-safe; keeps only the given faces, in ascending order, and their vertices, and renumbers them from 0
+        void clear();
+        void view(const vec3 *positions, const vec3 *normals, uint32_t vertexCount,
+            const Triangle *triangles, const Plane *planes, const uint16_t *materialIds, const uint32_t *objectIds, uint32_t faceCount); // Reads the columns in place, e.g. from a mapped file
+        void own(); // Copies viewed columns into the store
+
+        uint32_t getVertexCount() const;
+        uint32_t getFaceCount() const;
+
+        const vec3 &position(uint32_t v) const { return positions[v]; }
+        const vec3 &normal(uint32_t v) const { return normals[v]; }
+        const Triangle &triangle(uint32_t f) const { return triangles[f]; }
+        const Plane &plane(uint32_t f) const { return planes[f]; }
+        uint16_t materialId(uint32_t f) const { return materialIds[f]; } // An id of the scene's MaterialTable
+        uint32_t objectId(uint32_t f) const { return objectIds[f]; } // The inserted object the face or its original belongs to
+
+        Face getFace(uint32_t f) const; // An expanded copy of the geometry
+
+        const Arena<vec3> &getPositions() const { return positions; }
+        const Arena<vec3> &getNormals() const { return normals; }
+        const Arena<Triangle> &getTriangles() const { return triangles; }
+        const Arena<Plane> &getPlanes() const { return planes; }
+        const Arena<uint16_t> &getMaterialIds() const { return materialIds; }
+        const Arena<uint32_t> &getObjectIds() const { return objectIds; }
+
+    private:
+        // Per vertex; positions counts the vertices
+        Arena<vec3> positions;
+        Arena<vec3> normals;
+
+        // Per face; triangles counts the faces
+        Arena<Triangle> triangles;
+        Arena<Plane> planes;
+        Arena<uint16_t> materialIds;
+        Arena<uint32_t> objectIds;
+};
+
+#endif
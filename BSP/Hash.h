@@ -0,0 +1,21 @@
+#ifndef HASH
+#define HASH
+
+#include <cstddef>
+#include <cstdint>
+
+const uint64_t FNV_OFFSET = 0xcbf29ce484222325ull;
+const uint64_t FNV_PRIME = 0x100000001b3ull;
+
+// 64-bit FNV-1a; pass the previous result as hash to continue over several blocks
+inline uint64_t fnv1a(const void *data, size_t size, uint64_t hash = FNV_OFFSET)
+{
+    const unsigned char *bytes = (const unsigned char *) data;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+#endif
@@ -0,0 +1,76 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "MappedFile.h"
+
+MappedFile::MappedFile(const string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) == 0)
+    {
+        length = info.st_size;
+        if (length == 0) // mmap refuses empty files
+        {
+            opened = true;
+        }
+        else
+        {
+            void *p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                mapped = (const char *) p;
+                opened = true;
+                madvise(p, length, MADV_SEQUENTIAL);
+            }
+        }
+    }
+    close(fd); // The mapping stays valid without the descriptor
+}
+
+MappedFile::~MappedFile()
+{
+    if (mapped != nullptr)
+    {
+        munmap((void *) mapped, length);
+    }
+}
+
+bool MappedFile::isOpen() const
+{
+    return opened;
+}
+
+const char *MappedFile::data() const
+{
+    return mapped;
+}
+
+size_t MappedFile::size() const
+{
+    return opened ? length : 0;
+}
+
+bool replaceFile(const string &path, const function<bool(FILE *)> &write)
+{
+    string temporaryPath = path + ".tmp";
+    FILE *file = fopen(temporaryPath.c_str(), "wb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+    bool written = write(file);
+    written = fclose(file) == 0 && written;
+    if (!written || rename(temporaryPath.c_str(), path.c_str()) != 0)
+    {
+        remove(temporaryPath.c_str());
+        return false;
+    }
+    return true;
+}
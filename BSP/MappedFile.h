@@ -0,0 +1,33 @@
+#ifndef MAPPED_FILE
+#define MAPPED_FILE
+
+#include <string>
+#include <cstddef>
+#include <cstdio>
+#include <functional>
+using namespace std;
+
+// A read-only view of a whole file mapped into memory
+class MappedFile
+{
+    public:
+        MappedFile(const string &path);
+        ~MappedFile();
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        bool isOpen() const;
+        const char *data() const;
+        size_t size() const;
+
+    private:
+        const char *mapped = nullptr;
+        size_t length = 0;
+        bool opened = false;
+};
+
+// Calls write on a temporary file next to path and renames it over path, so a MappedFile never sees a half-written file.
+// Returns false, leaving path as it was, if the file cannot be created, write returns false or closing fails.
+bool replaceFile(const string &path, const function<bool(FILE *)> &write);
+
+#endif
@@ -0,0 +1,82 @@
+#include <cstring>
+#include "Material.h"
+
+uint16_t MaterialTable::add(const Material &material)
+{
+    for (size_t i = 0; i < materials.size(); ++i)
+    {
+        if (memcmp(&materials[i], &material, sizeof(Material)) == 0)
+        {
+            return i;
+        }
+    }
+
+    materials.push_back(material);
+    return materials.size() - 1;
+}
+
+const Material &MaterialTable::get(uint16_t id) const
+{
+    return materials[id];
+}
+
+int MaterialTable::size() const
+{
+    return materials.size();
+}
+
+bool MaterialTable::isTranslucent(uint16_t id) const
+{
+    return materials[id].diffuse[3] < 1.0f;
+}
+
+void MaterialTable::bind(uint16_t id)
+{
+    if (id == bound)
+    {
+        elided += 4;
+        return;
+    }
+
+    const Material &m = materials[id];
+    const Material *current = bound < 0 ? nullptr : &materials[bound];
+    setProperty(GL_DIFFUSE, m.diffuse, current ? current->diffuse : nullptr, 4);
+    setProperty(GL_SPECULAR, m.specular, current ? current->specular : nullptr, 4);
+    setProperty(GL_SHININESS, m.shininess, current ? current->shininess : nullptr, 1);
+    setProperty(GL_EMISSION, m.emission, current ? current->emission : nullptr, 4);
+
+    bound = id;
+}
+
+void MaterialTable::unbind()
+{
+    bound = -1;
+}
+
+void MaterialTable::beginFrame()
+{
+    issued = 0;
+    elided = 0;
+}
+
+int MaterialTable::getIssuedCount() const
+{
+    return issued;
+}
+
+int MaterialTable::getElidedCount() const
+{
+    return elided;
+}
+
+void MaterialTable::setProperty(GLenum property, const GLfloat *value, const GLfloat *current, int length)
+{
+    if (current != nullptr && memcmp(value, current, length * sizeof(GLfloat)) == 0)
+    {
+        ++elided;
+        return;
+    }
+
+    glMaterialfv(GL_FRONT_AND_BACK, property, value);
+    ++issued;
+}
@@ -0,0 +1,43 @@
+#ifndef MATERIAL
+#define MATERIAL
+
+#include <vector>
+#include <cstdint>
+#include <GL/gl.h>
+using namespace std;
+
+struct Material
+{
+    GLfloat diffuse[4]; // Diffuse color
+    GLfloat specular[4]; // Amount of specular reflection of each component
+    GLfloat shininess[1]; // Specular range; higher value results a narrower specular reflection range
+    GLfloat emission[4]; // Emiting color
+};
+
+// Registry of every material in the scene, referenced by faces through 16-bit ids.
+// It also tracks the material currently set in GL so that drawing only issues the properties that actually change.
+class MaterialTable
+{
+    public:
+        uint16_t add(const Material &material); // Returns the id of an identical material if there is one
+        const Material &get(uint16_t id) const;
+        int size() const;
+        bool isTranslucent(uint16_t id) const; // Its diffuse alpha is below 1, so it blends with what is behind it
+
+        void bind(uint16_t id); // Set the material in GL, skipping properties that are already set
+        void unbind(); // Forget what is set, e.g. after someone else called glMaterial
+
+        void beginFrame(); // Reset the per-frame counters
+        int getIssuedCount() const; // glMaterialfv calls made this frame
+        int getElidedCount() const; // glMaterialfv calls skipped this frame
+
+    private:
+        vector<Material> materials;
+        int bound = -1;
+        int issued = 0;
+        int elided = 0;
+
+        void setProperty(GLenum property, const GLfloat *value, const GLfloat *current, int length);
+};
+
+#endif
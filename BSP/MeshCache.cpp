@@ -0,0 +1,115 @@
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+#include "MeshCache.h"
+#include "MappedFile.h"
+#include "Hash.h"
+
+static_assert(sizeof(vec3) == 3 * sizeof(float), "vec3 is stored as three packed floats");
+static_assert(sizeof(MeshCorner) == 2 * sizeof(uint32_t), "MeshCorner is stored as two packed indices");
+
+static uint64_t getChecksum(const void *positions, size_t positionBytes, const void *normals, size_t normalBytes, const void *corners, size_t cornerBytes)
+{
+    uint64_t hash = fnv1a(positions, positionBytes);
+    hash = fnv1a(normals, normalBytes, hash);
+    return fnv1a(corners, cornerBytes, hash);
+}
+
+static bool getSourceInfo(const string &sourcePath, uint64_t *outSize, int64_t *outTime)
+{
+    struct stat info;
+    if (stat(sourcePath.c_str(), &info) != 0)
+    {
+        return false;
+    }
+    *outSize = info.st_size;
+    *outTime = (int64_t) info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+    return true;
+}
+
+string getMeshCachePath(const string &sourcePath)
+{
+    return sourcePath + ".meshcache";
+}
+
+bool readMeshCache(const string &sourcePath, Mesh *outMesh)
+{
+    uint64_t sourceSize;
+    int64_t sourceTime;
+    if (!getSourceInfo(sourcePath, &sourceSize, &sourceTime))
+    {
+        return false;
+    }
+
+    MappedFile file(getMeshCachePath(sourcePath));
+    if (!file.isOpen() || file.size() < sizeof(MeshCacheHeader))
+    {
+        return false;
+    }
+
+    MeshCacheHeader header;
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != MESH_CACHE_VERSION
+        || header.sourceSize != sourceSize || header.sourceTime != sourceTime)
+    {
+        return false;
+    }
+
+    // Counts are checked one by one so that a damaged header cannot overflow the sum
+    size_t available = file.size() - sizeof(header);
+    if (header.positionCount > available / sizeof(vec3) || header.normalCount > available / sizeof(vec3)
+        || header.cornerCount > available / sizeof(MeshCorner))
+    {
+        return false;
+    }
+    size_t positionBytes = header.positionCount * sizeof(vec3);
+    size_t normalBytes = header.normalCount * sizeof(vec3);
+    size_t cornerBytes = header.cornerCount * sizeof(MeshCorner);
+    if (positionBytes + normalBytes + cornerBytes != available)
+    {
+        return false;
+    }
+
+    const char *positions = file.data() + sizeof(header);
+    const char *normals = positions + positionBytes;
+    const char *corners = normals + normalBytes;
+    if (getChecksum(positions, positionBytes, normals, normalBytes, corners, cornerBytes) != header.checksum)
+    {
+        return false;
+    }
+
+    outMesh->positions.resize(header.positionCount);
+    outMesh->normals.resize(header.normalCount);
+    outMesh->corners.resize(header.cornerCount);
+    memcpy(outMesh->positions.data(), positions, positionBytes);
+    memcpy(outMesh->normals.data(), normals, normalBytes);
+    memcpy(outMesh->corners.data(), corners, cornerBytes);
+    return true;
+}
+
+bool writeMeshCache(const string &sourcePath, const Mesh &mesh)
+{
+    MeshCacheHeader header = {};
+    memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(header.magic));
+    header.version = MESH_CACHE_VERSION;
+    if (!getSourceInfo(sourcePath, &header.sourceSize, &header.sourceTime))
+    {
+        return false;
+    }
+    header.positionCount = mesh.positions.size();
+    header.normalCount = mesh.normals.size();
+    header.cornerCount = mesh.corners.size();
+
+    size_t positionBytes = mesh.positions.size() * sizeof(vec3);
+    size_t normalBytes = mesh.normals.size() * sizeof(vec3);
+    size_t cornerBytes = mesh.corners.size() * sizeof(MeshCorner);
+    header.checksum = getChecksum(mesh.positions.data(), positionBytes, mesh.normals.data(), normalBytes, mesh.corners.data(), cornerBytes);
+
+    return replaceFile(getMeshCachePath(sourcePath), [&](FILE *file)
+    {
+        return fwrite(&header, sizeof(header), 1, file) == 1
+            && fwrite(mesh.positions.data(), 1, positionBytes, file) == positionBytes
+            && fwrite(mesh.normals.data(), 1, normalBytes, file) == normalBytes
+            && fwrite(mesh.corners.data(), 1, cornerBytes, file) == cornerBytes;
+    });
+}
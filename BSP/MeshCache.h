@@ -0,0 +1,29 @@
+#ifndef MESH_CACHE
+#define MESH_CACHE
+
+#include <string>
+#include <cstdint>
+#include "objImporter.h"
+using namespace std;
+
+const char MESH_CACHE_MAGIC[4] = {'B', 'S', 'P', 'M'};
+const uint32_t MESH_CACHE_VERSION = 1;
+
+// Laid out at the start of a cache file, followed by the positions, normals and corners packed back to back
+struct MeshCacheHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t sourceSize; // Size and modification time of the .obj file the cache was made from
+    int64_t sourceTime; // Nanoseconds
+    uint64_t positionCount;
+    uint64_t normalCount;
+    uint64_t cornerCount;
+    uint64_t checksum; // FNV-1a over the packed arrays
+};
+
+string getMeshCachePath(const string &sourcePath);
+bool readMeshCache(const string &sourcePath, Mesh *outMesh); // False if the cache is missing, stale or damaged
+bool writeMeshCache(const string &sourcePath, const Mesh &mesh);
+
+#endif
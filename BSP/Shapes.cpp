@@ -0,0 +1,128 @@
+#include <random>
+#include <cmath>
+#include "Shapes.h"
+
+vector<Face> getSphere(float radius, int segment) // The center is located at (0, 0, 0)
+{
+    vector<Face> faces;
+    for (float phi = 0.0f; phi < M_PI; phi += M_PI / segment)
+    {
+        for (float theta = 0.0f; theta < (2.0f + 1e-2f) * M_PI; theta += M_PI / segment)
+        {
+            float x;
+            float y;
+            float z;
+
+            // Face 1
+            Face f1;
+
+            x = radius * cos(theta) * sin(phi);
+            y = radius * sin(theta) * sin(phi);
+            z = radius * cos(phi);
+            f1.v1 = vec3(x, y, z);
+            f1.n1 = normalize(vec3(x, y, z));
+
+            x = radius * cos(theta + M_PI / segment) * sin(phi);
+            y = radius * sin(theta + M_PI / segment) * sin(phi);
+            z = radius * cos(phi);
+            f1.v2 = vec3(x, y, z);
+            f1.n2 = normalize(vec3(x, y, z));
+
+            x = radius * cos(theta) * sin(phi + M_PI / segment);
+            y = radius * sin(theta) * sin(phi + M_PI / segment);
+            z = radius * cos(phi + M_PI / segment);
+            f1.v3 = vec3(x, y, z);
+            f1.n3 = normalize(vec3(x, y, z));
+
+            faces.push_back(f1);
+
+            // Face2
+            Face f2;
+
+            x = radius * cos(theta) * sin(phi + M_PI / segment);
+            y = radius * sin(theta) * sin(phi + M_PI / segment);
+            z = radius * cos(phi + M_PI / segment);
+            f2.v1 = vec3(x, y, z);
+            f2.n1 = normalize(vec3(x, y, z));
+
+            x = radius * cos(theta + M_PI / segment) * sin(phi);
+            y = radius * sin(theta + M_PI / segment) * sin(phi);
+            z = radius * cos(phi);
+            f2.v2 = vec3(x, y, z);
+            f2.n2 = normalize(vec3(x, y, z));
+
+            x = radius * cos(theta + M_PI / segment) * sin(phi + M_PI / segment);
+            y = radius * sin(theta + M_PI / segment) * sin(phi + M_PI / segment);
+            z = radius * cos(phi + M_PI / segment);
+            f2.v3 = vec3(x, y, z);
+            f2.n3 = normalize(vec3(x, y, z));
+
+            faces.push_back(f2);
+        }
+    }
+
+    return faces;
+}
+
+vector<Face> getQuad(float x, float z)
+{
+    float halfX = x / 2.0f;
+    float halfZ = z / 2.0f;
+    vector<Face> faces;
+
+    // Make f1
+    Face f1;
+    f1.v1 = vec3(-halfX, 0, halfZ);
+    f1.n1 = vec3(0, 1, 0);
+
+    f1.v2 = vec3(halfX, 0, -halfZ);
+    f1.n2 = vec3(0, 1, 0);
+
+    f1.v3 = vec3(-halfX, 0, -halfZ);
+    f1.n3 = vec3(0, 1, 0);
+
+    faces.push_back(f1);
+
+    // Make f2
+    Face f2;
+    f2.v1 = vec3(halfX, 0, halfZ);
+    f2.n1 = vec3(0, 1, 0);
+
+    f2.v2 = vec3(halfX, 0, -halfZ);
+    f2.n2 = vec3(0, 1, 0);
+
+    f2.v3 = vec3(-halfX, 0, halfZ);
+    f2.n3 = vec3(0, 1, 0);
+
+    faces.push_back(f2);
+
+    return faces;
+}
+
+vector<Face> getRandomTriangles(int count, float extent, float size, uint32_t seed)
+{
+    minstd_rand rng(seed); // The same arguments always yield the same triangles
+    uniform_real_distribution<float> inBox(-extent / 2.0f, extent / 2.0f);
+    uniform_real_distribution<float> offset(-size / 2.0f, size / 2.0f);
+
+    vector<Face> faces;
+    faces.reserve(count);
+    while ((int) faces.size() < count)
+    {
+        vec3 center(inBox(rng), inBox(rng), inBox(rng));
+        Face f;
+        f.v1 = center + vec3(offset(rng), offset(rng), offset(rng));
+        f.v2 = center + vec3(offset(rng), offset(rng), offset(rng));
+        f.v3 = center + vec3(offset(rng), offset(rng), offset(rng));
+
+        vec3 normal = cross(f.v2 - f.v1, f.v3 - f.v1);
+        if (length(normal) < 1e-6f) // Too thin to have a plane
+        {
+            continue;
+        }
+        f.n1 = f.n2 = f.n3 = normalize(normal);
+        faces.push_back(f);
+    }
+
+    return faces;
+}
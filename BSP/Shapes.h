@@ -0,0 +1,13 @@
+#ifndef SHAPES
+#define SHAPES
+
+#include <vector>
+#include <cstdint>
+#include "Face.h"
+using namespace std;
+
+vector<Face> getSphere(float radius, int segment); // The center is located at (0, 0, 0)
+vector<Face> getQuad(float x, float z); // Lies in the xz-plane facing +y, centered at (0, 0, 0)
+vector<Face> getRandomTriangles(int count, float extent, float size, uint32_t seed = 1); // Triangles about size across, centered at random within a cube of edge extent around (0, 0, 0)
+
+#endif
@@ -0,0 +1,275 @@
+#include <cmath>
+#include "Simd.h"
+
+// The vector kernels and the scalar remainder must round alike, or a corner right at the tolerance lands on different sides.
+// Contracting their multiplies and adds into fused ones is up to the compiler for each loop, so it is turned off here.
+#pragma GCC optimize("fp-contract=off")
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+static uint8_t classifyOne(float d1, float d2, float d3, float onPlaneEps, float frontEps)
+{
+    bool isOffPlane = fabs(d1) >= onPlaneEps && fabs(d2) >= onPlaneEps && fabs(d3) >= onPlaneEps;
+    bool isOnPlane = fabs(d1) < onPlaneEps && fabs(d2) < onPlaneEps && fabs(d3) < onPlaneEps;
+    bool hasFront = d1 > 0 || d2 > 0 || d3 > 0;
+    bool hasBack = d1 < 0 || d2 < 0 || d3 < 0;
+
+    if (isOffPlane && hasFront && hasBack)
+    {
+        return SIDE_SPANNING;
+    }
+    if (isOnPlane)
+    {
+        return SIDE_COPLANAR;
+    }
+    return d1 + d2 + d3 >= frontEps ? SIDE_FRONT : SIDE_BACK;
+}
+
+static void writeSides(int spanningMask, int coplanarMask, int frontMask, int width, uint8_t *outSides)
+{
+    for (int j = 0; j < width; ++j)
+    {
+        if ((spanningMask >> j) & 1)
+        {
+            outSides[j] = SIDE_SPANNING;
+        }
+        else if ((coplanarMask >> j) & 1)
+        {
+            outSides[j] = SIDE_COPLANAR;
+        }
+        else
+        {
+            outSides[j] = ((frontMask >> j) & 1) ? SIDE_FRONT : SIDE_BACK;
+        }
+    }
+}
+
+void classifyTriangles(const Plane &plane, const float *coords, int stride, int count, float onPlaneEps, float frontEps, uint8_t *outSides)
+{
+    int i = 0;
+
+#if defined(__AVX2__)
+    const __m256 nx = _mm256_set1_ps(plane.N.x);
+    const __m256 ny = _mm256_set1_ps(plane.N.y);
+    const __m256 nz = _mm256_set1_ps(plane.N.z);
+    const __m256 nd = _mm256_set1_ps(plane.D);
+    const __m256 signBit = _mm256_set1_ps(-0.0f);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 eps = _mm256_set1_ps(onPlaneEps);
+    const __m256 front = _mm256_set1_ps(frontEps);
+
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 d[3];
+        for (int k = 0; k < 3; ++k) // Signed distances of the k-th corners
+        {
+            __m256 x = _mm256_loadu_ps(coords + (3 * k) * stride + i);
+            __m256 y = _mm256_loadu_ps(coords + (3 * k + 1) * stride + i);
+            __m256 z = _mm256_loadu_ps(coords + (3 * k + 2) * stride + i);
+            d[k] = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, x), _mm256_mul_ps(ny, y)), _mm256_mul_ps(nz, z)), nd);
+        }
+
+        __m256 lowest = _mm256_min_ps(_mm256_min_ps(d[0], d[1]), d[2]);
+        __m256 highest = _mm256_max_ps(_mm256_max_ps(d[0], d[1]), d[2]);
+        __m256 nearest = _mm256_min_ps(_mm256_min_ps(_mm256_andnot_ps(signBit, d[0]), _mm256_andnot_ps(signBit, d[1])), _mm256_andnot_ps(signBit, d[2]));
+        __m256 farthest = _mm256_max_ps(_mm256_max_ps(_mm256_andnot_ps(signBit, d[0]), _mm256_andnot_ps(signBit, d[1])), _mm256_andnot_ps(signBit, d[2]));
+        __m256 sum = _mm256_add_ps(_mm256_add_ps(d[0], d[1]), d[2]);
+
+        __m256 spanning = _mm256_and_ps(_mm256_cmp_ps(nearest, eps, _CMP_GE_OQ), _mm256_and_ps(_mm256_cmp_ps(lowest, zero, _CMP_LT_OQ), _mm256_cmp_ps(highest, zero, _CMP_GT_OQ)));
+        writeSides(_mm256_movemask_ps(spanning), _mm256_movemask_ps(_mm256_cmp_ps(farthest, eps, _CMP_LT_OQ)), _mm256_movemask_ps(_mm256_cmp_ps(sum, front, _CMP_GE_OQ)), 8, outSides + i);
+    }
+#elif defined(__SSE2__)
+    const __m128 nx = _mm_set1_ps(plane.N.x);
+    const __m128 ny = _mm_set1_ps(plane.N.y);
+    const __m128 nz = _mm_set1_ps(plane.N.z);
+    const __m128 nd = _mm_set1_ps(plane.D);
+    const __m128 signBit = _mm_set1_ps(-0.0f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 eps = _mm_set1_ps(onPlaneEps);
+    const __m128 front = _mm_set1_ps(frontEps);
+
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 d[3];
+        for (int k = 0; k < 3; ++k) // Signed distances of the k-th corners
+        {
+            __m128 x = _mm_loadu_ps(coords + (3 * k) * stride + i);
+            __m128 y = _mm_loadu_ps(coords + (3 * k + 1) * stride + i);
+            __m128 z = _mm_loadu_ps(coords + (3 * k + 2) * stride + i);
+            d[k] = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, x), _mm_mul_ps(ny, y)), _mm_mul_ps(nz, z)), nd);
+        }
+
+        __m128 lowest = _mm_min_ps(_mm_min_ps(d[0], d[1]), d[2]);
+        __m128 highest = _mm_max_ps(_mm_max_ps(d[0], d[1]), d[2]);
+        __m128 nearest = _mm_min_ps(_mm_min_ps(_mm_andnot_ps(signBit, d[0]), _mm_andnot_ps(signBit, d[1])), _mm_andnot_ps(signBit, d[2]));
+        __m128 farthest = _mm_max_ps(_mm_max_ps(_mm_andnot_ps(signBit, d[0]), _mm_andnot_ps(signBit, d[1])), _mm_andnot_ps(signBit, d[2]));
+        __m128 sum = _mm_add_ps(_mm_add_ps(d[0], d[1]), d[2]);
+
+        __m128 spanning = _mm_and_ps(_mm_cmpge_ps(nearest, eps), _mm_and_ps(_mm_cmplt_ps(lowest, zero), _mm_cmpgt_ps(highest, zero)));
+        writeSides(_mm_movemask_ps(spanning), _mm_movemask_ps(_mm_cmplt_ps(farthest, eps)), _mm_movemask_ps(_mm_cmpge_ps(sum, front)), 4, outSides + i);
+    }
+#endif
+
+    for (; i < count; ++i) // Scalar fallback and remainder
+    {
+        float d[3];
+        for (int k = 0; k < 3; ++k)
+        {
+            float x = coords[(3 * k) * stride + i];
+            float y = coords[(3 * k + 1) * stride + i];
+            float z = coords[(3 * k + 2) * stride + i];
+            d[k] = plane.N.x * x + plane.N.y * y + plane.N.z * z + plane.D;
+        }
+        outSides[i] = classifyOne(d[0], d[1], d[2], onPlaneEps, frontEps);
+    }
+}
+
+static uint8_t classifyOneRobust(float d1, float d2, float d3, float tolerance)
+{
+    bool hasFront = d1 > tolerance || d2 > tolerance || d3 > tolerance;
+    bool hasBack = d1 < -tolerance || d2 < -tolerance || d3 < -tolerance;
+
+    if (hasFront && hasBack)
+    {
+        return SIDE_SPANNING;
+    }
+    return hasFront ? SIDE_FRONT : (hasBack ? SIDE_BACK : SIDE_COPLANAR);
+}
+
+static void writeRobustSides(int frontMask, int backMask, int width, uint8_t *outSides)
+{
+    static const uint8_t sides[4] = {SIDE_COPLANAR, SIDE_FRONT, SIDE_BACK, SIDE_SPANNING}; // Indexed by the back bit and the front bit
+    for (int j = 0; j < width; ++j)
+    {
+        outSides[j] = sides[((backMask >> j) & 1) << 1 | ((frontMask >> j) & 1)];
+    }
+}
+
+void classifyTrianglesRobust(const Plane &plane, const float *coords, int stride, int count, float tolerance, uint8_t *outSides)
+{
+    int i = 0;
+
+#if defined(__AVX2__)
+    const __m256 nx = _mm256_set1_ps(plane.N.x);
+    const __m256 ny = _mm256_set1_ps(plane.N.y);
+    const __m256 nz = _mm256_set1_ps(plane.N.z);
+    const __m256 nd = _mm256_set1_ps(plane.D);
+    const __m256 above = _mm256_set1_ps(tolerance);
+    const __m256 below = _mm256_set1_ps(-tolerance);
+
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 d[3];
+        for (int k = 0; k < 3; ++k)
+        {
+            __m256 x = _mm256_loadu_ps(coords + (3 * k) * stride + i);
+            __m256 y = _mm256_loadu_ps(coords + (3 * k + 1) * stride + i);
+            __m256 z = _mm256_loadu_ps(coords + (3 * k + 2) * stride + i);
+            d[k] = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, x), _mm256_mul_ps(ny, y)), _mm256_mul_ps(nz, z)), nd);
+        }
+
+        __m256 lowest = _mm256_min_ps(_mm256_min_ps(d[0], d[1]), d[2]);
+        __m256 highest = _mm256_max_ps(_mm256_max_ps(d[0], d[1]), d[2]);
+        writeRobustSides(_mm256_movemask_ps(_mm256_cmp_ps(highest, above, _CMP_GT_OQ)), _mm256_movemask_ps(_mm256_cmp_ps(lowest, below, _CMP_LT_OQ)), 8, outSides + i);
+    }
+#elif defined(__SSE2__)
+    const __m128 nx = _mm_set1_ps(plane.N.x);
+    const __m128 ny = _mm_set1_ps(plane.N.y);
+    const __m128 nz = _mm_set1_ps(plane.N.z);
+    const __m128 nd = _mm_set1_ps(plane.D);
+    const __m128 above = _mm_set1_ps(tolerance);
+    const __m128 below = _mm_set1_ps(-tolerance);
+
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 d[3];
+        for (int k = 0; k < 3; ++k)
+        {
+            __m128 x = _mm_loadu_ps(coords + (3 * k) * stride + i);
+            __m128 y = _mm_loadu_ps(coords + (3 * k + 1) * stride + i);
+            __m128 z = _mm_loadu_ps(coords + (3 * k + 2) * stride + i);
+            d[k] = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, x), _mm_mul_ps(ny, y)), _mm_mul_ps(nz, z)), nd);
+        }
+
+        __m128 lowest = _mm_min_ps(_mm_min_ps(d[0], d[1]), d[2]);
+        __m128 highest = _mm_max_ps(_mm_max_ps(d[0], d[1]), d[2]);
+        writeRobustSides(_mm_movemask_ps(_mm_cmpgt_ps(highest, above)), _mm_movemask_ps(_mm_cmplt_ps(lowest, below)), 4, outSides + i);
+    }
+#endif
+
+    for (; i < count; ++i) // Scalar fallback and remainder
+    {
+        float d[3];
+        for (int k = 0; k < 3; ++k)
+        {
+            float x = coords[(3 * k) * stride + i];
+            float y = coords[(3 * k + 1) * stride + i];
+            float z = coords[(3 * k + 2) * stride + i];
+            d[k] = plane.N.x * x + plane.N.y * y + plane.N.z * z + plane.D;
+        }
+        outSides[i] = classifyOneRobust(d[0], d[1], d[2], tolerance);
+    }
+}
+
+// Each vertex is one 128-bit lane set; vec3 arrays interleave x, y and z, so wider registers would only add shuffles
+void transformPoints(const mat4x4 &transformation, const vec3 *in, int count, vec3 *out)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    const __m128 c0 = _mm_loadu_ps(&transformation[0][0]);
+    const __m128 c1 = _mm_loadu_ps(&transformation[1][0]);
+    const __m128 c2 = _mm_loadu_ps(&transformation[2][0]);
+    const __m128 c3 = _mm_loadu_ps(&transformation[3][0]);
+
+    for (; i < count; ++i)
+    {
+        __m128 p = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(in[i].x)), _mm_mul_ps(c1, _mm_set1_ps(in[i].y))),
+            _mm_add_ps(_mm_mul_ps(c2, _mm_set1_ps(in[i].z)), c3));
+        _mm_storel_pi((__m64 *) &out[i], p); // Exactly three floats, so out[i + 1] is never touched
+        _mm_store_ss(&out[i].z, _mm_movehl_ps(p, p));
+    }
+#endif
+
+    for (; i < count; ++i)
+    {
+        vec4 p = transformation * vec4(in[i].x, in[i].y, in[i].z, 1);
+        out[i] = vec3(p.x, p.y, p.z);
+    }
+}
+
+void transformNormals(const mat3 &normalMatrix, const vec3 *in, int count, vec3 *out)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    const __m128 c0 = _mm_setr_ps(normalMatrix[0].x, normalMatrix[0].y, normalMatrix[0].z, 0);
+    const __m128 c1 = _mm_setr_ps(normalMatrix[1].x, normalMatrix[1].y, normalMatrix[1].z, 0);
+    const __m128 c2 = _mm_setr_ps(normalMatrix[2].x, normalMatrix[2].y, normalMatrix[2].z, 0);
+
+    for (; i < count; ++i)
+    {
+        __m128 n = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(in[i].x)), _mm_mul_ps(c1, _mm_set1_ps(in[i].y))), _mm_mul_ps(c2, _mm_set1_ps(in[i].z)));
+
+        // Squared length in every lane; the fourth lane is zero
+        __m128 squared = _mm_mul_ps(n, n);
+        squared = _mm_add_ps(squared, _mm_shuffle_ps(squared, squared, _MM_SHUFFLE(2, 3, 0, 1)));
+        squared = _mm_add_ps(squared, _mm_shuffle_ps(squared, squared, _MM_SHUFFLE(1, 0, 3, 2)));
+        if (_mm_cvtss_f32(squared) > 0)
+        {
+            n = _mm_div_ps(n, _mm_sqrt_ps(squared));
+        }
+
+        _mm_storel_pi((__m64 *) &out[i], n);
+        _mm_store_ss(&out[i].z, _mm_movehl_ps(n, n));
+    }
+#endif
+
+    for (; i < count; ++i)
+    {
+        vec3 n = normalMatrix * in[i];
+        out[i] = dot(n, n) > 0 ? normalize(n) : n;
+    }
+}
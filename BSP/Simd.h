@@ -0,0 +1,45 @@
+#ifndef SIMD
+#define SIMD
+
+#include <cstdint>
+#include <vector>
+#include <glm/glm.hpp>
+#include "FaceStore.h"
+using namespace std;
+using namespace glm;
+
+enum Side
+{
+    SIDE_BACK,
+    SIDE_FRONT,
+    SIDE_SPANNING, // Has corners clearly on both sides and has to be split
+    SIDE_COPLANAR // Every corner is within the tolerance of the plane
+};
+
+const int SIMD_WIDTH = 8; // Strides of coordinate arrays are padded to a multiple of this
+
+// Corner coordinates of a list of triangles laid out for classifyTriangles
+struct TriangleCoords
+{
+    vector<float> coords;
+    int stride = 0;
+    int count = 0;
+};
+
+// Classify count triangles against a plane at once.
+// coords holds nine rows of stride floats: x, y, z of the first corners, then of the second and the third corners.
+// A triangle spans the plane when every corner is at least onPlaneEps away from it and the corners lie on both sides.
+// It is coplanar when every corner is closer than onPlaneEps, and otherwise in front when the sum of the corner distances is at least frontEps.
+void classifyTriangles(const Plane &plane, const float *coords, int stride, int count, float onPlaneEps, float frontEps, uint8_t *outSides);
+
+// Same layout as classifyTriangles. A triangle spans the plane when one corner is more than tolerance in front of it and another more than tolerance behind it,
+// even if the third lies on the plane. Otherwise it is on the side of the corners off the plane, or coplanar when there are none.
+void classifyTrianglesRobust(const Plane &plane, const float *coords, int stride, int count, float tolerance, uint8_t *outSides);
+
+// Transform count points by a model matrix; out may be in.
+void transformPoints(const mat4x4 &transformation, const vec3 *in, int count, vec3 *out);
+
+// Transform count normals by a normal matrix, the inverse transpose of the model matrix's upper 3x3, and normalize them; out may be in.
+void transformNormals(const mat3 &normalMatrix, const vec3 *in, int count, vec3 *out);
+
+#endif
@@ -0,0 +1,140 @@
+#include "TaskPool.h"
+
+// The worker a thread runs as, and its pool; a thread of one pool submitting to another is outside that one
+static thread_local const TaskPool *currentPool = nullptr;
+static thread_local int currentWorker = 0;
+
+TaskPool::TaskPool(int threadCount)
+: stopping(false), queued(0)
+{
+    if (threadCount <= 0)
+    {
+        threadCount = max(1u, thread::hardware_concurrency());
+    }
+
+    for (int i = 0; i < threadCount; ++i)
+    {
+        workers.push_back(make_unique<Worker>());
+    }
+    for (int i = 1; i < threadCount; ++i) // The calling thread works as workers[0] while waiting
+    {
+        threads.emplace_back(&TaskPool::workerLoop, this, i);
+    }
+}
+
+TaskPool::~TaskPool()
+{
+    {
+        lock_guard<mutex> guard(sleepLock);
+        stopping = true;
+    }
+    wakeUp.notify_all();
+
+    for (thread &t : threads)
+    {
+        t.join();
+    }
+}
+
+void TaskPool::submit(function<void()> task)
+{
+    Worker &w = *workers[getSelf()];
+    {
+        lock_guard<mutex> guard(w.lock);
+        w.tasks.push_back(move(task));
+    }
+
+    {
+        lock_guard<mutex> guard(sleepLock);
+        ++queued;
+    }
+    wakeUp.notify_one();
+    progress.notify_all(); // Waiters run tasks too, and may be the only threads free to
+}
+
+void TaskPool::wait(const atomic<int> &pending)
+{
+    int self = getSelf();
+    while (pending.load() > 0)
+    {
+        if (runOne(self))
+        {
+            continue;
+        }
+
+        // Nothing left to steal; the tasks still pending are running on other threads
+        unique_lock<mutex> guard(sleepLock);
+        progress.wait(guard, [&]() { return pending.load() == 0 || queued > 0; });
+    }
+}
+
+int TaskPool::getThreadCount() const
+{
+    return workers.size();
+}
+
+int TaskPool::getSelf() const
+{
+    return currentPool == this ? currentWorker : 0;
+}
+
+bool TaskPool::runOne(int self)
+{
+    function<void()> task;
+
+    Worker &own = *workers[self];
+    {
+        lock_guard<mutex> guard(own.lock);
+        if (!own.tasks.empty()) // Newest task first; its data is likely still in cache
+        {
+            task = move(own.tasks.back());
+            own.tasks.pop_back();
+        }
+    }
+
+    for (size_t i = 1; !task && i < workers.size(); ++i)
+    {
+        Worker &victim = *workers[(self + i) % workers.size()];
+        lock_guard<mutex> guard(victim.lock);
+        if (!victim.tasks.empty()) // Steal the oldest task, which tends to be the largest one
+        {
+            task = move(victim.tasks.front());
+            victim.tasks.pop_front();
+        }
+    }
+
+    if (!task)
+    {
+        return false;
+    }
+
+    --queued;
+    task();
+
+    {
+        lock_guard<mutex> guard(sleepLock); // Orders the task's effects on pending before a waiter checks it again
+    }
+    progress.notify_all();
+    return true;
+}
+
+void TaskPool::workerLoop(int self)
+{
+    currentPool = this;
+    currentWorker = self;
+
+    while (true)
+    {
+        if (runOne(self))
+        {
+            continue;
+        }
+
+        unique_lock<mutex> guard(sleepLock);
+        wakeUp.wait(guard, [this]() { return stopping || queued > 0; });
+        if (stopping)
+        {
+            return;
+        }
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef TASK_POOL
+#define TASK_POOL
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+using namespace std;
+
+// A pool of worker threads with one task deque per worker.
+// A worker pops its own newest task first and steals the oldest task of another worker when it runs dry.
+class TaskPool
+{
+    public:
+        TaskPool(int threadCount = 0); // 0: one thread per hardware core
+        ~TaskPool();
+
+        void submit(function<void()> task);
+        void wait(const atomic<int> &pending); // Run queued tasks until pending drops to zero; sleeps while there are none
+        int getThreadCount() const;
+
+    private:
+        struct Worker
+        {
+            deque<function<void()>> tasks;
+            mutex lock;
+        };
+
+        vector<unique_ptr<Worker>> workers; // workers[0] is shared by threads outside the pool
+        vector<thread> threads;
+        atomic<bool> stopping;
+        atomic<int> queued;
+        mutex sleepLock;
+        condition_variable wakeUp; // Idle workers; notified when a task is queued
+        condition_variable progress; // Waiters; notified when a task is queued or finishes
+
+        int getSelf() const; // The worker of the calling thread, or 0 outside the pool
+        bool runOne(int self);
+        void workerLoop(int self);
+};
+
+#endif
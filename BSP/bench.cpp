@@ -0,0 +1,307 @@
+#include <benchmark/benchmark.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cmath>
+#include "objImporter.h"
+#include "BSPTree.h"
+#include "Simd.h"
+#include "Shapes.h"
+using namespace std;
+using namespace glm;
+
+// Headless benchmarks of parsing, building and traversing trees; run from this directory so that ./Models is found.
+// Trees are built and traversed but never drawn, so no GL context is needed.
+
+const char *MODELS[] = {"Cube", "Key", "LED", "Panel", "Plane", "SmallPlane", "Sphere", "ThinkPad", "TrackPoint"};
+
+static MaterialTable materials;
+static uint16_t opaque;
+static uint16_t translucent;
+
+// ==================== Synthetic scenes ====================
+static mat4x4 getTranslation(const vec3 &offset)
+{
+    mat4x4 transformation(1.0f);
+    transformation[3] = vec4(offset, 1.0f);
+    return transformation;
+}
+
+// Spheres of the viewer's kind on a cubic grid, every other one translucent
+static void insertSpheres(BSPTree *tree, int count)
+{
+    vector<Face> sphere = getSphere(0.5f, 8);
+    int side = (int) ceil(cbrt((double) count));
+    for (int i = 0; i < count; ++i)
+    {
+        vec3 cell(i % side, i / side % side, i / (side * side));
+        tree->insertFaces(sphere, getTranslation((cell - vec3(side / 2.0f)) * 1.5f), i % 2 == 0 ? translucent : opaque);
+    }
+}
+
+static void setUpTree(BSPTree *tree)
+{
+    tree->setRobustSplitting(true); // The viewer's settings
+    tree->setLeafSize(256);
+}
+
+static void reportBuild(benchmark::State &state, const BSPTree &tree)
+{
+    const BuildStats &stats = tree.getBuildStats();
+    state.counters["faces"] = stats.inputFaces;
+    state.counters["fragments"] = stats.fragments;
+    state.counters["nodes"] = stats.nodeCount;
+    state.counters["depth"] = stats.maxDepth;
+}
+
+// ==================== Parsing ====================
+static void parseMeshBenchmark(benchmark::State &state, string path)
+{
+    ifstream file(path, ios::binary | ios::ate);
+    size_t bytes = file.tellg();
+    for (auto _ : state)
+    {
+        Mesh mesh = parseMesh(path);
+        benchmark::DoNotOptimize(mesh.corners.data());
+    }
+    state.SetBytesProcessed(state.iterations() * bytes);
+}
+
+static void parseDataBenchmark(benchmark::State &state, string path)
+{
+    for (auto _ : state)
+    {
+        vector<Face> faces = parseData(path);
+        benchmark::DoNotOptimize(faces.data());
+    }
+}
+
+// Through the mesh cache, as the viewer loads its models
+static void loadMeshBenchmark(benchmark::State &state, string path)
+{
+    loadMesh(path); // Writes the cache if it is missing
+    for (auto _ : state)
+    {
+        Mesh mesh = loadMesh(path);
+        benchmark::DoNotOptimize(mesh.corners.data());
+    }
+}
+
+// ==================== Building ====================
+static void buildModelBenchmark(benchmark::State &state, string path, SplitterPolicy policy)
+{
+    BSPTree tree(&materials, policy);
+    setUpTree(&tree);
+    tree.insertMesh(loadMesh(path), mat4x4(1.0f), translucent);
+    for (auto _ : state)
+    {
+        tree.build(); // Tears down the previous tree first
+    }
+    reportBuild(state, tree);
+}
+
+static void BM_BuildRandomTriangles(benchmark::State &state)
+{
+    int count = state.range(0);
+    BSPTree tree(&materials, (SplitterPolicy) state.range(1));
+    setUpTree(&tree);
+    tree.insertFaces(getRandomTriangles(count, 10.0f, 10.0f / cbrt((float) count)), mat4x4(1.0f), translucent);
+    for (auto _ : state)
+    {
+        tree.build();
+    }
+    reportBuild(state, tree);
+    state.SetComplexityN(count);
+}
+BENCHMARK(BM_BuildRandomTriangles)->ArgsProduct({benchmark::CreateRange(256, 16384, 4), {FIRST_FACE, BALANCED}})->Unit(benchmark::kMillisecond)->Complexity();
+
+static void BM_BuildSpheres(benchmark::State &state)
+{
+    int count = state.range(0);
+    BSPTree tree(&materials, (SplitterPolicy) state.range(1));
+    setUpTree(&tree);
+    insertSpheres(&tree, count);
+    for (auto _ : state)
+    {
+        tree.build();
+    }
+    reportBuild(state, tree);
+    state.SetComplexityN(count);
+}
+BENCHMARK(BM_BuildSpheres)->ArgsProduct({benchmark::CreateRange(1, 64, 4), {FIRST_FACE, BALANCED}})->Unit(benchmark::kMillisecond)->Complexity();
+
+// Random triangles overlap each other everywhere, so both subtrees of most nodes are large enough to be built in parallel
+static void BM_BuildThreads(benchmark::State &state)
+{
+    BSPTree tree(&materials, BALANCED);
+    setUpTree(&tree);
+    tree.setBuildThreads(state.range(0));
+    tree.insertFaces(getRandomTriangles(16384, 10.0f, 0.4f), mat4x4(1.0f), translucent);
+    for (auto _ : state)
+    {
+        tree.build();
+    }
+    reportBuild(state, tree);
+}
+BENCHMARK(BM_BuildThreads)->Arg(1)->Arg(2)->Arg(4)->Arg(0)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// ==================== Inserting ====================
+static void BM_InsertFaces(benchmark::State &state)
+{
+    int count = state.range(0);
+    vector<Face> sphere = getSphere(0.5f, 8);
+    for (auto _ : state)
+    {
+        state.PauseTiming(); // Setting up and tearing down the chunk tables of the arenas would dominate
+        unique_ptr<BSPTree> tree(new BSPTree(&materials));
+        state.ResumeTiming();
+
+        for (int i = 0; i < count; ++i)
+        {
+            tree->insertFaces(sphere, getTranslation(vec3(i, 0, 0)), opaque);
+        }
+        benchmark::DoNotOptimize(tree.get());
+
+        state.PauseTiming();
+        tree.reset();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * count * sphere.size());
+}
+BENCHMARK(BM_InsertFaces)->RangeMultiplier(4)->Range(1, 64);
+
+// One more sphere pushed down a built tree of spheres instead of rebuilding it
+static void BM_InsertIntoBuiltTree(benchmark::State &state)
+{
+    vector<Face> sphere = getSphere(0.5f, 8);
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        unique_ptr<BSPTree> tree(new BSPTree(&materials, BALANCED));
+        setUpTree(tree.get());
+        insertSpheres(tree.get(), state.range(0));
+        tree->build();
+        state.ResumeTiming();
+
+        tree->insertFaces(sphere, getTranslation(vec3(0.3f, 0.2f, 0.1f)), translucent); // Overlaps the spheres at the center
+
+        state.PauseTiming();
+        tree.reset(); // Destroyed outside the timed region as well
+        state.ResumeTiming();
+    }
+}
+BENCHMARK(BM_InsertIntoBuiltTree)->RangeMultiplier(4)->Range(1, 64)->Unit(benchmark::kMicrosecond);
+
+// ==================== Classification ====================
+static void BM_ClassifyTriangles(benchmark::State &state)
+{
+    int count = state.range(0);
+    bool isRobust = state.range(1);
+    vector<Face> faces = getRandomTriangles(count, 10.0f, 1.0f);
+
+    // The layout classifyTriangles takes: nine rows of x, y, z per corner
+    TriangleCoords coords;
+    coords.count = count;
+    coords.stride = (count + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH;
+    coords.coords.assign(9 * coords.stride, 0.0f);
+    for (int i = 0; i < count; ++i)
+    {
+        const vec3 *corners[3] = {&faces[i].v1, &faces[i].v2, &faces[i].v3};
+        for (int k = 0; k < 9; ++k)
+        {
+            coords.coords[k * coords.stride + i] = (*corners[k / 3])[k % 3];
+        }
+    }
+
+    Plane plane;
+    plane.N = normalize(vec3(1, 2, 3));
+    plane.D = 0.0f; // Through the middle of the triangles
+    vector<uint8_t> sides(count);
+    for (auto _ : state)
+    {
+        if (isRobust)
+        {
+            classifyTrianglesRobust(plane, coords.coords.data(), coords.stride, count, 1e-4f, sides.data());
+        }
+        else
+        {
+            classifyTriangles(plane, coords.coords.data(), coords.stride, count, eps1, eps2, sides.data());
+        }
+        benchmark::DoNotOptimize(sides.data());
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_ClassifyTriangles)->ArgsProduct({benchmark::CreateRange(64, 65536, 8), {0, 1}});
+
+// ==================== Traversal ====================
+struct Camera
+{
+    const char *name;
+    vec3 eye;
+};
+
+const Camera CAMERAS[] = {
+    {"inside", vec3(0.2f, 0.1f, 0.3f)}, // Among the spheres
+    {"near", vec3(0.0f, 2.0f, 8.0f)},
+    {"far", vec3(0.0f, 10.0f, 40.0f)}, // Everything in view
+    {"above", vec3(0.1f, 30.0f, 0.0f)}
+};
+
+// Orders the faces of 64 spheres and a floor, with or without culling them against the view frustum
+static void BM_Traverse(benchmark::State &state)
+{
+    static BSPTree *tree = nullptr;
+    if (tree == nullptr) // Built once for every camera
+    {
+        tree = new BSPTree(&materials, BALANCED);
+        setUpTree(tree);
+        insertSpheres(tree, 64);
+        tree->insertFaces(getQuad(20.0f, 20.0f), getTranslation(vec3(0.0f, -4.0f, 0.0f)), opaque);
+        tree->build();
+    }
+
+    const Camera &camera = CAMERAS[state.range(0)];
+    bool isCulling = state.range(1);
+    Frustum frustum = getFrustum(perspective(radians(45.0f), 4.0f / 3.0f, 0.1f, 100.0f), lookAt(camera.eye, vec3(0.0f), vec3(0.0f, 1.0f, 0.0f)));
+
+    vector<uint32_t> order;
+    FrameStats stats;
+    for (auto _ : state)
+    {
+        tree->traverse(camera.eye, BACK_TO_FRONT, &order, isCulling ? &frustum : nullptr, &stats);
+        benchmark::DoNotOptimize(order.data());
+    }
+    state.SetLabel(camera.name);
+    state.counters["visited"] = stats.nodesVisited;
+    state.counters["emitted"] = stats.facesEmitted;
+}
+BENCHMARK(BM_Traverse)->ArgsProduct({{0, 1, 2, 3}, {0, 1}})->Unit(benchmark::kMicrosecond);
+
+int main(int argc, char **argv)
+{
+    opaque = materials.add({{0.8f, 0.8f, 0.8f, 1.0f}, {0.5f, 0.5f, 0.5f, 1.0f}, {20.0f}, {0.0f, 0.0f, 0.0f, 1.0f}});
+    translucent = materials.add({{0.1f, 0.2f, 0.9f, 0.5f}, {1.0f, 1.0f, 1.0f, 1.0f}, {100.0f}, {0.0f, 0.0f, 0.0f, 1.0f}});
+
+    // Every model gets its own entries
+    for (const char *model : MODELS)
+    {
+        string path = string("./Models/") + model + ".obj";
+        benchmark::RegisterBenchmark(("BM_ParseMesh/" + string(model)).c_str(), parseMeshBenchmark, path);
+        benchmark::RegisterBenchmark(("BM_ParseData/" + string(model)).c_str(), parseDataBenchmark, path);
+        benchmark::RegisterBenchmark(("BM_LoadMesh/" + string(model)).c_str(), loadMeshBenchmark, path);
+        benchmark::RegisterBenchmark(("BM_BuildModel/" + string(model) + "/FIRST_FACE").c_str(), buildModelBenchmark, path, FIRST_FACE)->Unit(benchmark::kMillisecond);
+        benchmark::RegisterBenchmark(("BM_BuildModel/" + string(model) + "/BALANCED").c_str(), buildModelBenchmark, path, BALANCED)->Unit(benchmark::kMillisecond);
+    }
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -5,112 +5,262 @@
 #include <vector>
 #include <fstream>
 #include <iostream>
-#include <sstream>
+#include <cstring>
+#include <charconv>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 #include "objImporter.h"
+#include "MappedFile.h"
+#include "MeshCache.h"
+#include "TaskPool.h"
 using namespace std;
 
-vector<Face> parseData(string path)
+static const char *skipSpaces(const char *p, const char *end)
 {
-    ifstream file(path);
-    if (file.is_open())
-    {
-        string line;
-        vector<vector<string>> reservedFaceLines;
-        vector<vec3> vertices;
-        vector<vec3> vertexNormals;
-        while (getline(file, line))
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+    {
+        ++p;
+    }
+    return p;
+}
+
+static const char *skipLine(const char *p, const char *end)
+{
+    const char *newline = (const char *) memchr(p, '\n', end - p);
+    return newline == nullptr ? end : newline + 1;
+}
+
+static const char *parseVec3(const char *p, const char *end, vec3 *out) // out should be zeroed by the caller
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        p = skipSpaces(p, end);
+        if (p < end && *p == '+') // from_chars does not take an explicit plus sign
         {
-            vector<string> sep = split(line, ' ');
-            if (sep.size() == 0) // Comment line
-            {
-                continue;
-            }
+            ++p;
+        }
+        from_chars_result result = from_chars(p, end, (*out)[i]);
+        if (result.ec == errc::invalid_argument) // Not a number; the rest of the line is skipped and the missing components stay as they were
+        {
+            return p;
+        }
+        p = result.ptr; // Out of range values are consumed but leave the component as it was
+    }
+    return p;
+}
 
-            string first = sep[0];
-            if (first == "v")
-            {
-                vec3 vertex;
-                vertex.x = stof(sep[1]);
-                vertex.y = stof(sep[2]);
-                vertex.z = stof(sep[3]);
-                vertices.push_back(vertex);
-            }
-            else if (first == "vn")
-            {
-                vec3 normal;
-                normal.x = stof(sep[1]);
-                normal.y = stof(sep[2]);
-                normal.z = stof(sep[3]);
-                vertexNormals.push_back(normal);
-            }
-            else if (first == "f")
+static uint32_t resolveIndex(long index, size_t count, bool *isRelative) // .obj indices start from 1, and negative ones count back from the latest element
+{
+    if (index > 0)
+    {
+        return index - 1;
+    }
+    else if (index < 0)
+    {
+        *isRelative = true;
+        return count + index;
+    }
+    return NO_NORMAL;
+}
+
+static const char *parseCorner(const char *p, const char *end, size_t positionCount, size_t normalCount, MeshCorner *out, bool *isRelative)
+{
+    long index = 0;
+    p = from_chars(skipSpaces(p, end), end, index).ptr;
+    out->position = resolveIndex(index, positionCount, isRelative);
+    out->normal = NO_NORMAL;
+
+    if (p < end && *p == '/')
+    {
+        long texture = 0;
+        p = from_chars(p + 1, end, texture).ptr; // Texture coordinates are not used
+        if (p < end && *p == '/')
+        {
+            index = 0;
+            p = from_chars(p + 1, end, index).ptr;
+            out->normal = resolveIndex(index, normalCount, isRelative);
+        }
+    }
+    return p;
+}
+
+// Parse whole lines in [p, end) in place, appending to mesh; no line or token is copied into a string.
+// positionBase and normalBase count the vertices and normals defined before p. Returns whether any index was relative to them.
+static bool parseRange(const char *p, const char *end, size_t positionBase, size_t normalBase, Mesh *outMesh)
+{
+    Mesh &mesh = *outMesh;
+    bool isRelative = false;
+    while (p < end)
+    {
+        p = skipSpaces(p, end);
+        if (end - p >= 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+        {
+            vec3 vertex(0.0f);
+            p = parseVec3(p + 2, end, &vertex);
+            mesh.positions.push_back(vertex);
+        }
+        else if (end - p >= 3 && p[0] == 'v' && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t'))
+        {
+            vec3 normal(0.0f);
+            p = parseVec3(p + 3, end, &normal);
+            mesh.normals.push_back(normal);
+        }
+        else if (end - p >= 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+        {
+            MeshCorner corners[3];
+            p += 2;
+            for (int i = 0; i < 3; ++i)
             {
-                reservedFaceLines.push_back(sep);
+                p = parseCorner(p, end, positionBase + mesh.positions.size(), normalBase + mesh.normals.size(), &corners[i], &isRelative);
             }
+            mesh.corners.insert(mesh.corners.end(), corners, corners + 3); // Only triangulated faces are supported
         }
+        p = skipLine(p, end); // Comments, other records and whatever follows the parsed values
+    }
+
+    return isRelative;
+}
+
+Mesh parseMesh(string path, int threadCount)
+{
+    MappedFile file(path);
+    if (!file.isOpen())
+    {
+        cout << path << " does not exist" << endl;
+        return {};
+    }
+
+    const char *data = file.data();
+    size_t size = file.size();
+    if (threadCount == 0)
+    {
+        threadCount = max(1u, thread::hardware_concurrency());
+    }
+
+    Mesh mesh;
+    if (threadCount == 1 || size < PARALLEL_PARSE_MIN_BYTES)
+    {
+        parseRange(data, data + size, 0, 0, &mesh);
+        return mesh;
+    }
+
+    // Cut the file into chunks ending at line breaks
+    int chunkCount = threadCount * 4; // More chunks than threads evens out dense and sparse regions
+    vector<const char *> bounds = {data};
+    for (int i = 1; i < chunkCount; ++i)
+    {
+        const char *bound = max(bounds.back(), data + size * i / chunkCount);
+        bounds.push_back(skipLine(bound, data + size));
+    }
+    bounds.push_back(data + size);
+
+    // Parse every chunk on its own, resolving relative indices as if nothing came before it
+    TaskPool pool(threadCount);
+    vector<Mesh> chunks(chunkCount);
+    vector<char> isRelative(chunkCount);
+    atomic<int> pending(chunkCount);
+    for (int i = 0; i < chunkCount; ++i)
+    {
+        pool.submit([&, i]()
+        {
+            isRelative[i] = parseRange(bounds[i], bounds[i + 1], 0, 0, &chunks[i]);
+            --pending;
+        });
+    }
+    pool.wait(pending);
+
+    // Vertices and normals defined before each chunk
+    vector<size_t> positionBases(chunkCount + 1, 0);
+    vector<size_t> normalBases(chunkCount + 1, 0);
+    for (int i = 0; i < chunkCount; ++i)
+    {
+        positionBases[i + 1] = positionBases[i] + chunks[i].positions.size();
+        normalBases[i + 1] = normalBases[i] + chunks[i].normals.size();
+    }
 
-        vector<Face> faces;
-        for (vector<string> sep : reservedFaceLines)
+    // Absolute indices are already right; chunks with relative ones are parsed again with their real bases
+    for (int i = 0; i < chunkCount; ++i)
+    {
+        if (isRelative[i])
         {
-            string sep1 = sep[1]; // First vertex information
-            string sep2 = sep[2];
-            string sep3 = sep[3];
-
-            vector<string> info1 = split(sep1, '/');
-            vector<string> info2 = split(sep2, '/');
-            vector<string> info3 = split(sep3, '/');
-
-            int vertexIdx1 = stoi(info1[0]) - 1;
-            vec3 vertex1 = vertices[vertexIdx1];
-            int normalIdx1 = stoi(info1[2]) - 1;
-            vec3 normal1 = vertexNormals[normalIdx1];
-
-            int vertexIdx2 = stoi(info2[0]) - 1;
-            vec3 vertex2 = vertices[vertexIdx2];
-            int normalIdx2 = stoi(info2[2]) - 1;
-            vec3 normal2 = vertexNormals[normalIdx2];
-
-            int vertexIdx3 = stoi(info3[0]) - 1;
-            vec3 vertex3 = vertices[vertexIdx3];
-            int normalIdx3 = stoi(info3[2]) - 1;
-            vec3 normal3 = vertexNormals[normalIdx3];
-
-            // Define a face
-            Face f;
-            f.v1 = vertex1;
-            f.v2 = vertex2;
-            f.v3 = vertex3;
-
-            f.n1 = normal1;
-            f.n2 = normal2;
-            f.n3 = normal3;
-
-            faces.push_back(f);
+            ++pending;
+            pool.submit([&, i]()
+            {
+                chunks[i] = Mesh();
+                parseRange(bounds[i], bounds[i + 1], positionBases[i], normalBases[i], &chunks[i]);
+                --pending;
+            });
         }
+    }
+    pool.wait(pending);
 
-        return faces;
+    size_t cornerCount = 0;
+    for (const Mesh &chunk : chunks)
+    {
+        cornerCount += chunk.corners.size();
     }
-    else
+
+    mesh.positions.reserve(positionBases[chunkCount]);
+    mesh.normals.reserve(normalBases[chunkCount]);
+    mesh.corners.reserve(cornerCount);
+    for (const Mesh &chunk : chunks)
     {
-        cout << path << " does not exist" << endl;
-        return {};
+        mesh.positions.insert(mesh.positions.end(), chunk.positions.begin(), chunk.positions.end());
+        mesh.normals.insert(mesh.normals.end(), chunk.normals.begin(), chunk.normals.end());
+        mesh.corners.insert(mesh.corners.end(), chunk.corners.begin(), chunk.corners.end());
     }
+
+    return mesh;
 }
 
-vector<string> split(string input, char delimiter) 
+vector<Face> expandMesh(const Mesh &mesh)
 {
-    vector<string> result;
-    stringstream ss(input);
-    string temp;
- 
-    while (getline(ss, temp, delimiter)) 
-    {
-        if (*temp.cbegin() == '#') // Ignore comments after the first #
-        { 
-            break;
+    vector<Face> faces;
+    faces.reserve(mesh.corners.size() / 3);
+
+    for (size_t i = 0; i + 2 < mesh.corners.size(); i += 3)
+    {
+        const MeshCorner *c = &mesh.corners[i];
+        if (c[0].position >= mesh.positions.size() || c[1].position >= mesh.positions.size() || c[2].position >= mesh.positions.size())
+        {
+            continue; // Refers to a vertex the file does not have
         }
-        result.push_back(temp);
+
+        // Define a face
+        Face f;
+        f.v1 = mesh.positions[c[0].position];
+        f.v2 = mesh.positions[c[1].position];
+        f.v3 = mesh.positions[c[2].position];
+
+        vec3 faceNormal = normalize(cross(f.v2 - f.v1, f.v3 - f.v1)); // For corners without a normal
+        f.n1 = c[0].normal < mesh.normals.size() ? mesh.normals[c[0].normal] : faceNormal;
+        f.n2 = c[1].normal < mesh.normals.size() ? mesh.normals[c[1].normal] : faceNormal;
+        f.n3 = c[2].normal < mesh.normals.size() ? mesh.normals[c[2].normal] : faceNormal;
+
+        faces.push_back(f);
     }
- 
-    return result;
-}
\ No newline at end of file
+
+    return faces;
+}
+
+Mesh loadMesh(string path, int threadCount)
+{
+    Mesh mesh;
+    if (readMeshCache(path, &mesh))
+    {
+        return mesh;
+    }
+
+    mesh = parseMesh(path, threadCount);
+    if (!mesh.corners.empty())
+    {
+        writeMeshCache(path, mesh); // Best effort; a read-only directory only costs the parse next time
+    }
+    return mesh;
+}
+
+vector<Face> parseData(string path, int threadCount)
+{
+    return expandMesh(parseMesh(path, threadCount));
+}
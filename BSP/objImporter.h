@@ -4,11 +4,32 @@
 #include <vector>
 #include <string>
 #include <cmath>
+#include <cstdint>
 #include "Face.h"
 using namespace std;
 
-vector<Face> parseData(string path);
-vector<string> split(string input, char delimiter);
+struct MeshCorner
+{
+    uint32_t position; // Index into Mesh::positions
+    uint32_t normal; // Index into Mesh::normals; NO_NORMAL if the file gives none
+};
+
+const uint32_t NO_NORMAL = 0xFFFFFFFF;
+
+// Indexed geometry as stored in a .obj file
+struct Mesh
+{
+    vector<vec3> positions;
+    vector<vec3> normals;
+    vector<MeshCorner> corners; // Three per triangle
+};
+
+const size_t PARALLEL_PARSE_MIN_BYTES = 1 << 20; // Smaller files are parsed by the calling thread alone
+
+Mesh parseMesh(string path, int threadCount = 1); // threadCount 0 uses every hardware core
+Mesh loadMesh(string path, int threadCount = 1); // parseMesh through the binary cache next to the file
+vector<Face> expandMesh(const Mesh &mesh);
+vector<Face> parseData(string path, int threadCount = 1); // expandMesh of parseMesh; never reads or writes the cache
 void debug();
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,854 @@
+#include <gtest/gtest.h>
+#include <glm/glm.hpp>
+#include <vector>
+#include <new>
+#include <fstream>
+#include <string>
+#include <cstring>
+#include <algorithm>
+#include <random>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "Arena.h"
+#include "BSPTree.h"
+#include "Shapes.h"
+#include "TaskPool.h"
+#include "Simd.h"
+#include "objImporter.h"
+#include "MeshCache.h"
+using namespace std;
+using namespace glm;
+
+// Headless tests of the BSP tree; trees are built and traversed but never drawn, so no GL context is needed.
+
+static MaterialTable materials;
+static uint16_t translucent = materials.add({{0.1f, 0.2f, 0.9f, 0.5f}, {1.0f, 1.0f, 1.0f, 1.0f}, {100.0f}, {0.0f, 0.0f, 0.0f, 1.0f}});
+static uint16_t opaque = materials.add({{0.8f, 0.8f, 0.8f, 1.0f}, {0.5f, 0.5f, 0.5f, 1.0f}, {20.0f}, {0.0f, 0.0f, 0.0f, 1.0f}});
+static uint16_t nearlyOpaque = materials.add({{0.8f, 0.8f, 0.8f, 0.99f}, {0.5f, 0.5f, 0.5f, 1.0f}, {20.0f}, {0.0f, 0.0f, 0.0f, 1.0f}});
+
+const vec3 EYES[] = {vec3(0.0f, 0.0f, 0.0f), vec3(3.0f, 1.0f, 12.0f), vec3(-20.0f, 5.0f, -2.0f), vec3(0.5f, 30.0f, 0.5f)};
+
+// The corners of the faces in the order the tree gives them
+static vector<vec3> getOrderedCorners(const BSPTree &tree, const vec3 &eye)
+{
+    vector<uint32_t> order;
+    tree.traverse(eye, BACK_TO_FRONT, &order);
+    vector<vec3> corners;
+    for (uint32_t f : order)
+    {
+        Face face = tree.getFace(f);
+        corners.insert(corners.end(), {face.v1, face.v2, face.v3});
+    }
+    return corners;
+}
+
+// ==================== Arena ====================
+TEST(ArenaTest, OwnsOnlyTheViewedElementsWhenItGrows)
+{
+    vector<uint32_t> data(Arena<uint32_t>::CHUNK_SIZE + 10);
+    for (size_t i = 0; i < data.size(); ++i)
+    {
+        data[i] = (uint32_t) i;
+    }
+    Arena<uint32_t> arena;
+    arena.view(data.data(), (uint32_t) data.size());
+    uint32_t index = arena.push(7); // Copies the viewed array before it grows
+    data.assign(data.size(), 0); // The array may now go away
+
+    ASSERT_FALSE(arena.isViewing());
+    EXPECT_EQ(index, Arena<uint32_t>::CHUNK_SIZE + 10);
+    EXPECT_EQ(arena[Arena<uint32_t>::CHUNK_SIZE + 9], Arena<uint32_t>::CHUNK_SIZE + 9);
+    EXPECT_EQ(arena[index], 7u);
+}
+
+TEST(ArenaTest, ThrowsPastItsCapacity)
+{
+    Arena<uint32_t> arena;
+    arena.push(7);
+    EXPECT_THROW(arena.allocate(Arena<uint32_t>::MAX_CHUNKS << Arena<uint32_t>::CHUNK_BITS), bad_alloc);
+    EXPECT_EQ(arena.size(), 1u); // Nothing was counted that has no chunk
+    EXPECT_EQ(arena.push(8), 1u);
+}
+
+// ==================== Classification ====================
+// The layout classifyTriangles takes: nine rows of x, y, z per corner
+static TriangleCoords layOut(const vector<Face> &faces)
+{
+    TriangleCoords coords;
+    coords.count = faces.size();
+    coords.stride = (coords.count + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH;
+    coords.coords.assign(9 * coords.stride, 0.0f);
+    for (int i = 0; i < coords.count; ++i)
+    {
+        const vec3 *corners[3] = {&faces[i].v1, &faces[i].v2, &faces[i].v3};
+        for (int k = 0; k < 9; ++k)
+        {
+            coords.coords[k * coords.stride + i] = (*corners[k / 3])[k % 3];
+        }
+    }
+    return coords;
+}
+
+// Random triangles, and triangles with corners on the plane, within the tolerance of it and just past it
+static vector<Face> getTrianglesAround(const Plane &plane, float tolerance, minstd_rand *rng)
+{
+    vector<Face> faces = getRandomTriangles(500, 2.0f, 1.0f, (*rng)());
+    uniform_real_distribution<float> coordinate(-2.0f, 2.0f);
+    uniform_int_distribution<int> offset(-4, 4);
+    vec3 u = normalize(cross(plane.N, abs(plane.N.x) < 0.9f ? vec3(1, 0, 0) : vec3(0, 1, 0)));
+    vec3 v = cross(plane.N, u);
+    for (int i = 0; i < 527; ++i) // Leaves a tail that fills no whole register
+    {
+        vec3 corners[3];
+        for (vec3 &corner : corners)
+        {
+            vec3 onPlane = -plane.D * plane.N + coordinate(*rng) * u + coordinate(*rng) * v;
+            corner = onPlane + plane.N * (offset(*rng) * 0.5f * tolerance); // Multiples of half the tolerance, zero included
+        }
+        faces.push_back(Face(corners[0], corners[1], corners[2], plane.N, plane.N, plane.N));
+    }
+    return faces;
+}
+
+// Whichever vector kernel is compiled in must agree with the scalar classification, which a single triangle always takes
+TEST(ClassifyTest, VectorKernelsMatchTheScalarPath)
+{
+    minstd_rand rng(7);
+    uniform_real_distribution<float> component(-1.0f, 1.0f);
+    for (int p = 0; p < 20; ++p)
+    {
+        Plane plane;
+        plane.N = normalize(vec3(component(rng), component(rng), component(rng)));
+        plane.D = component(rng);
+        vector<Face> faces = getTrianglesAround(plane, 1e-3f, &rng);
+        TriangleCoords coords = layOut(faces);
+
+        vector<uint8_t> sides(coords.count);
+        vector<uint8_t> robustSides(coords.count);
+        classifyTriangles(plane, coords.coords.data(), coords.stride, coords.count, 1e-3f, 1e-3f, sides.data());
+        classifyTrianglesRobust(plane, coords.coords.data(), coords.stride, coords.count, 1e-3f, robustSides.data());
+        int counts[4] = {};
+        for (int i = 0; i < coords.count; ++i)
+        {
+            uint8_t side;
+            classifyTriangles(plane, coords.coords.data() + i, coords.stride, 1, 1e-3f, 1e-3f, &side);
+            ASSERT_EQ(sides[i], side) << "plane " << p << " triangle " << i;
+            classifyTrianglesRobust(plane, coords.coords.data() + i, coords.stride, 1, 1e-3f, &side);
+            ASSERT_EQ(robustSides[i], side) << "plane " << p << " triangle " << i;
+            ++counts[side];
+        }
+        for (int side = SIDE_BACK; side <= SIDE_COPLANAR; ++side) // Every case is reached
+        {
+            EXPECT_GT(counts[side], 0) << "plane " << p << " side " << side;
+        }
+    }
+}
+
+// ==================== Transforming ====================
+// Sheared and scaled by different amounts along each axis, so a normal only stays perpendicular through the inverse transpose
+const mat4x4 SHEARED(vec4(2.0f, 0.3f, 0.0f, 0.0f), vec4(0.7f, 0.5f, -0.2f, 0.0f), vec4(-0.3f, 0.4f, 3.0f, 0.0f), vec4(1.0f, -2.0f, 5.0f, 1.0f));
+
+static vector<vec3> getRandomVectors(int count, minstd_rand *rng)
+{
+    uniform_real_distribution<float> component(-10.0f, 10.0f);
+    vector<vec3> vectors(count);
+    for (vec3 &v : vectors)
+    {
+        v = vec3(component(*rng), component(*rng), component(*rng));
+    }
+    return vectors;
+}
+
+TEST(TransformTest, PointsMatchTheModelMatrix)
+{
+    minstd_rand rng(11);
+    vector<vec3> points = getRandomVectors(37, &rng); // Not a multiple of the vector width, so the remainder is covered
+    vector<vec3> transformed(points.size());
+    transformPoints(SHEARED, points.data(), points.size(), transformed.data());
+    for (size_t i = 0; i < points.size(); ++i)
+    {
+        vec3 expected = vec3(SHEARED * vec4(points[i], 1.0f));
+        EXPECT_LT(length(transformed[i] - expected), 1e-4f) << "point " << i;
+    }
+
+    transformPoints(SHEARED, points.data(), points.size(), points.data()); // In place
+    EXPECT_EQ(points, transformed);
+}
+
+TEST(TransformTest, NormalsMatchTheInverseTranspose)
+{
+    minstd_rand rng(13);
+    vector<vec3> normals = getRandomVectors(37, &rng);
+    mat3 normalMatrix = mat3(transpose(inverse(SHEARED)));
+    vector<vec3> transformed(normals.size());
+    transformNormals(normalMatrix, normals.data(), normals.size(), transformed.data());
+    for (size_t i = 0; i < normals.size(); ++i)
+    {
+        vec3 expected = normalize(normalMatrix * normals[i]);
+        EXPECT_LT(length(transformed[i] - expected), 1e-5f) << "normal " << i;
+        EXPECT_NEAR(length(transformed[i]), 1.0f, 1e-5f);
+    }
+
+    transformNormals(normalMatrix, normals.data(), normals.size(), normals.data()); // In place
+    EXPECT_EQ(normals, transformed);
+}
+
+TEST(TransformTest, InsertedNormalsStayPerpendicularToTheirFaces)
+{
+    BSPTree tree(&materials, BALANCED);
+    vector<Face> triangles = getRandomTriangles(16, 10.0f, 1.5f);
+    for (Face &f : triangles)
+    {
+        f.n1 = f.n2 = f.n3 = normalize(cross(f.v2 - f.v1, f.v3 - f.v1));
+    }
+    tree.insertFaces(triangles, SHEARED, translucent);
+    for (uint32_t i = 0; i < triangles.size(); ++i)
+    {
+        Face f = tree.getFace(i);
+        EXPECT_NEAR(dot(f.n1, normalize(f.v2 - f.v1)), 0.0f, 1e-4f) << "face " << i;
+        EXPECT_NEAR(dot(f.n1, normalize(f.v3 - f.v1)), 0.0f, 1e-4f) << "face " << i;
+    }
+}
+
+// ==================== Task pool ====================
+// Workers of a larger pool submit to a pool with a single deque, which their own worker index would overrun
+TEST(TaskPoolTest, TakesTasksFromTheThreadsOfAnotherPool)
+{
+    TaskPool outer(8);
+    TaskPool inner(1);
+    atomic<int> started(0);
+    atomic<int> runs(0);
+    atomic<int> outerPending(8);
+    for (int i = 0; i < 8; ++i)
+    {
+        outer.submit([&]()
+        {
+            ++started;
+            while (started < 8) // One task on each thread of the pool, so every worker index submits
+            {
+                this_thread::yield();
+            }
+
+            atomic<int> innerPending(1);
+            inner.submit([&]()
+            {
+                ++runs;
+                --innerPending;
+            });
+            inner.wait(innerPending);
+            --outerPending;
+        });
+    }
+    outer.wait(outerPending);
+    EXPECT_EQ(runs.load(), 8);
+}
+
+// Tasks waiting on tasks they submitted, as the parallel build does, all finish
+TEST(TaskPoolTest, FinishesNestedWaits)
+{
+    TaskPool pool(4);
+    atomic<int> leaves(0);
+    function<void(int)> split = [&](int depth)
+    {
+        if (depth == 0)
+        {
+            ++leaves;
+            return;
+        }
+        atomic<int> pending(1);
+        pool.submit([&]()
+        {
+            split(depth - 1);
+            --pending;
+        });
+        split(depth - 1);
+        pool.wait(pending);
+    };
+    split(10);
+    EXPECT_EQ(leaves.load(), 1024);
+}
+
+// ==================== Parallel build ====================
+class ParallelBuildTest : public testing::TestWithParam<tuple<SplitterPolicy, bool>>
+{
+};
+
+// Indices of nodes and fragments depend on the threads, but the planes, the splits and so the order of the geometry may not
+TEST_P(ParallelBuildTest, OrdersTheSameGeometryAsTheSerialBuild)
+{
+    vector<Face> triangles = getRandomTriangles(4096, 10.0f, 0.8f);
+    vector<vector<vec3>> serialCorners;
+    for (int threads : {1, 4})
+    {
+        BSPTree tree(&materials, get<0>(GetParam()));
+        tree.setRobustSplitting(get<1>(GetParam()));
+        tree.setBuildThreads(threads, 64); // Low enough for most subtrees to be handed out
+        tree.insertFaces(triangles, mat4x4(1.0f), translucent);
+        tree.build();
+
+        for (size_t e = 0; e < size(EYES); ++e)
+        {
+            vector<vec3> corners = getOrderedCorners(tree, EYES[e]);
+            if (threads == 1)
+            {
+                serialCorners.push_back(corners);
+                continue;
+            }
+            ASSERT_EQ(corners.size(), serialCorners[e].size());
+            EXPECT_TRUE(corners == serialCorners[e]) << "eye " << e;
+        }
+    }
+}
+INSTANTIATE_TEST_SUITE_P(Policies, ParallelBuildTest, testing::Combine(testing::Values(FIRST_FACE, BALANCED), testing::Bool()));
+
+// ==================== Robust splitting ====================
+struct SplitPieces
+{
+    vector<Face> front;
+    vector<Face> back;
+    BuildStats stats;
+};
+
+// Splits target, which should lie in the plane y = 0, by a large triangle in the plane z = 0 facing up, and collects the pieces the tree holds
+static SplitPieces splitByGround(const Face &target)
+{
+    const vec3 up(0.0f, 0.0f, 1.0f);
+    Face ground(vec3(-100.0f, -100.0f, 0.0f), vec3(100.0f, -100.0f, 0.0f), vec3(0.0f, 100.0f, 0.0f), up, up, up);
+    BSPTree tree(&materials, FIRST_FACE); // The ground splits
+    tree.setRobustSplitting(true);
+    tree.insertFaces({ground, target}, mat4x4(1.0f), translucent);
+    tree.build();
+
+    SplitPieces pieces;
+    pieces.stats = tree.getBuildStats();
+    vector<uint32_t> order;
+    tree.traverse(vec3(0.0f, 50.0f, 50.0f), BACK_TO_FRONT, &order);
+    for (uint32_t f : order)
+    {
+        Face face = tree.getFace(f);
+        if (face.v1.z == 0.0f && face.v2.z == 0.0f && face.v3.z == 0.0f)
+        {
+            continue; // The ground
+        }
+        bool isFront = face.v1.z + face.v2.z + face.v3.z > 0.0f;
+        (isFront ? pieces.front : pieces.back).push_back(face);
+    }
+    return pieces;
+}
+
+static vec3 getNormal(const Face &f)
+{
+    return cross(f.v2 - f.v1, f.v3 - f.v1);
+}
+
+static float getArea(const vector<Face> &faces)
+{
+    float area = 0.0f;
+    for (const Face &f : faces)
+    {
+        area += length(getNormal(f)) / 2.0f;
+    }
+    return area;
+}
+
+static bool hasCorners(const Face &f, const vec3 &p, const vec3 &q)
+{
+    auto isCorner = [&](const vec3 &c) { return distance(f.v1, c) < 1e-5f || distance(f.v2, c) < 1e-5f || distance(f.v3, c) < 1e-5f; };
+    return isCorner(p) && isCorner(q);
+}
+
+// Every piece faces the way the original did, and together they cover it
+static void expectCover(const Face &target, const SplitPieces &pieces, float areaTolerance = 1e-4f)
+{
+    vector<Face> all(pieces.front);
+    all.insert(all.end(), pieces.back.begin(), pieces.back.end());
+    for (const Face &f : all)
+    {
+        EXPECT_GT(dot(getNormal(f), getNormal(target)), 0.0f);
+    }
+    EXPECT_NEAR(getArea(all), getArea({target}), areaTolerance);
+}
+
+TEST(RobustSplitTest, CutsALoneCornerOffIntoThreePieces)
+{
+    const vec3 normal(0.0f, 1.0f, 0.0f);
+    vec3 corners[3] = {vec3(0.0f, 0.0f, 1.0f), vec3(1.0f, 0.0f, -1.0f), vec3(-1.0f, 0.0f, -1.0f)}; // The first alone in front
+    for (int lone = 0; lone < 3; ++lone) // Counted by the position of the lone corner in the face
+    {
+        Face target(corners[(3 - lone) % 3], corners[(4 - lone) % 3], corners[(5 - lone) % 3], normal, normal, normal);
+        SplitPieces pieces = splitByGround(target);
+        EXPECT_EQ(pieces.front.size(), 1u);
+        EXPECT_EQ(pieces.back.size(), 2u);
+        for (int k = 0; k < 3; ++k)
+        {
+            EXPECT_EQ(pieces.stats.threePieceSplits[k], k == lone ? 1u : 0u) << "lone corner " << lone;
+        }
+        EXPECT_EQ(pieces.stats.twoPieceSplits, 0u);
+        EXPECT_EQ(pieces.stats.fragments, 3u);
+        expectCover(target, pieces);
+    }
+}
+
+TEST(RobustSplitTest, CutsTheRestAlongItsShorterDiagonal)
+{
+    const vec3 normal(0.0f, 1.0f, 0.0f);
+    const vec3 a(0.0f, 0.0f, 1.0f);
+    for (float spread : {-5.0f, 5.0f}) // Leans the quadrilateral behind the ground either way
+    {
+        vec3 b(0.5f + max(spread, 0.0f), 0.0f, -1.0f);
+        vec3 c(-0.5f + min(spread, 0.0f), 0.0f, -1.0f);
+        vec3 i1 = (a + b) / 2.0f; // Where the edges cross the ground
+        vec3 i2 = (a + c) / 2.0f;
+        bool isFirstShorter = distance(i1, c) <= distance(b, i2);
+
+        Face target(a, b, c, normal, normal, normal);
+        SplitPieces pieces = splitByGround(target);
+        ASSERT_EQ(pieces.back.size(), 2u);
+        for (const Face &f : pieces.back)
+        {
+            EXPECT_EQ(hasCorners(f, i1, c), isFirstShorter) << "spread " << spread;
+            EXPECT_EQ(hasCorners(f, b, i2), !isFirstShorter) << "spread " << spread;
+        }
+        expectCover(target, pieces);
+    }
+}
+
+TEST(RobustSplitTest, CutsThroughACornerOnThePlaneIntoTwoPieces)
+{
+    const vec3 normal(0.0f, 1.0f, 0.0f);
+    Face target(vec3(0.0f, 0.0f, 0.0f), vec3(1.0f, 0.0f, 1.0f), vec3(0.5f, 0.0f, -1.0f), normal, normal, normal);
+    SplitPieces pieces = splitByGround(target);
+    EXPECT_EQ(pieces.front.size(), 1u);
+    EXPECT_EQ(pieces.back.size(), 1u);
+    EXPECT_EQ(pieces.stats.twoPieceSplits, 1u);
+    EXPECT_EQ(pieces.stats.fragments, 2u);
+    expectCover(target, pieces);
+}
+
+TEST(RobustSplitTest, DropsSlivers)
+{
+    // Both corners of the long edge are just past the tolerance, about 1.5e-3 for this scene, so one piece behind is thinner than that
+    const vec3 normal(0.0f, 1.0f, 0.0f);
+    Face target(vec3(0.0f, 0.0f, 0.002f), vec3(10.0f, 0.0f, -0.002f), vec3(0.0f, 0.0f, -10.0f), normal, normal, normal);
+    SplitPieces pieces = splitByGround(target);
+    EXPECT_EQ(pieces.stats.discardedFragments, 1u);
+    EXPECT_EQ(pieces.front.size() + pieces.back.size(), 2u);
+    expectCover(target, pieces, 0.01f); // Only the sliver is missing
+    vector<Face> kept(pieces.front);
+    kept.insert(kept.end(), pieces.back.begin(), pieces.back.end());
+    for (const Face &f : kept)
+    {
+        float longest = max(max(distance(f.v1, f.v2), distance(f.v2, f.v3)), distance(f.v3, f.v1));
+        EXPECT_GT(length(getNormal(f)) / longest, 1e-3f); // Its smallest height
+    }
+}
+
+// ==================== Coplanar faces ====================
+static mat4x4 getTranslation(float x, float y, float z)
+{
+    mat4x4 m(1.0f);
+    m[3] = vec4(x, y, z, 1.0f);
+    return m;
+}
+
+// A layer of quads in the plane at y, half of them facing down
+static vector<Face> getLayers(float y)
+{
+    const mat4x4 flip(vec4(1.0f, 0.0f, 0.0f, 0.0f), vec4(0.0f, -1.0f, 0.0f, 0.0f), vec4(0.0f, 0.0f, -1.0f, 0.0f), vec4(0.0f, 0.0f, 0.0f, 1.0f));
+    vector<Face> layer;
+    for (float x : {-1.5f, 1.5f})
+    {
+        for (float z : {-1.5f, 1.5f})
+        {
+            mat4x4 m = getTranslation(x, y, z) * (x > 0.0f ? flip : mat4x4(1.0f));
+            for (const Face &f : getQuad(2.0f, 2.0f))
+            {
+                layer.emplace_back(vec3(m * vec4(f.v1, 1.0f)), vec3(m * vec4(f.v2, 1.0f)), vec3(m * vec4(f.v3, 1.0f)), f.n1, f.n2, f.n3);
+            }
+        }
+    }
+    return layer;
+}
+
+// A unit cube wound outward, which a leaf can hold whole
+static vector<Face> getCube(const vec3 &center)
+{
+    const vec4 W(0.0f, 0.0f, 0.0f, 1.0f);
+    const mat4x4 rotations[6] = {
+        mat4x4(1.0f), // Top
+        mat4x4(vec4(1.0f, 0.0f, 0.0f, 0.0f), vec4(0.0f, -1.0f, 0.0f, 0.0f), vec4(0.0f, 0.0f, -1.0f, 0.0f), W), // Bottom
+        mat4x4(vec4(0.0f, -1.0f, 0.0f, 0.0f), vec4(1.0f, 0.0f, 0.0f, 0.0f), vec4(0.0f, 0.0f, 1.0f, 0.0f), W), // +x
+        mat4x4(vec4(0.0f, 1.0f, 0.0f, 0.0f), vec4(-1.0f, 0.0f, 0.0f, 0.0f), vec4(0.0f, 0.0f, 1.0f, 0.0f), W), // -x
+        mat4x4(vec4(1.0f, 0.0f, 0.0f, 0.0f), vec4(0.0f, 0.0f, 1.0f, 0.0f), vec4(0.0f, -1.0f, 0.0f, 0.0f), W), // +z
+        mat4x4(vec4(1.0f, 0.0f, 0.0f, 0.0f), vec4(0.0f, 0.0f, -1.0f, 0.0f), vec4(0.0f, 1.0f, 0.0f, 0.0f), W) // -z
+    };
+    vector<Face> cube;
+    for (const mat4x4 &rotation : rotations)
+    {
+        mat4x4 m = getTranslation(center.x, center.y, center.z) * rotation * getTranslation(0.0f, 0.5f, 0.0f);
+        for (const Face &f : getQuad(1.0f, 1.0f))
+        {
+            cube.emplace_back(vec3(m * vec4(f.v1, 1.0f)), vec3(m * vec4(f.v2, 1.0f)), vec3(m * vec4(f.v3, 1.0f)), f.n1, f.n2, f.n3);
+        }
+    }
+    return cube;
+}
+
+// Distance from eye along dir, a unit vector, to where the ray crosses f; negative if it misses
+static float getHitDistance(const vec3 &eye, const vec3 &dir, const Face &f)
+{
+    vec3 e1 = f.v2 - f.v1;
+    vec3 e2 = f.v3 - f.v1;
+    vec3 p = cross(dir, e2);
+    float det = dot(e1, p);
+    if (fabs(det) < 1e-9f) // Parallel to the face
+    {
+        return -1.0f;
+    }
+    vec3 s = eye - f.v1;
+    vec3 q = cross(s, e1);
+    float u = dot(s, p) / det;
+    float v = dot(dir, q) / det;
+    if (u < 0.0f || v < 0.0f || u + v > 1.0f)
+    {
+        return -1.0f;
+    }
+    return dot(e2, q) / det;
+}
+// Every face of the tree comes back once, and no face comes before a face behind it
+static void expectPaintersOrder(const BSPTree &tree, float area)
+{
+    for (const vec3 &eye : {vec3(4.0f, 3.0f, 1.0f), vec3(-3.0f, 1.0f, -2.0f), vec3(2.0f, -5.0f, 0.5f), vec3(0.0f, 0.5f, 4.0f)})
+    {
+        vector<uint32_t> order;
+        tree.traverse(eye, BACK_TO_FRONT, &order);
+        vector<uint32_t> sorted(order);
+        sort(sorted.begin(), sorted.end());
+        EXPECT_TRUE(adjacent_find(sorted.begin(), sorted.end()) == sorted.end()) << "eye " << eye.x;
+
+        vector<Face> faces;
+        for (uint32_t f : order)
+        {
+            faces.push_back(tree.getFace(f));
+        }
+        EXPECT_NEAR(getArea(faces), area, 1e-3f) << "eye " << eye.x; // Nothing is missing
+
+        // A ray through a point of every face has to cross the faces it hits in the reverse of their order; those in one plane tie
+        for (const Face &target : faces)
+        {
+            vec3 dir = normalize((target.v1 + target.v2 * 2.0f + target.v3 * 3.0f) / 6.0f - eye);
+            float lastDistance = INFINITY;
+            for (size_t i = 0; i < faces.size(); ++i)
+            {
+                float distance = getHitDistance(eye, dir, faces[i]);
+                if (distance > 0.0f)
+                {
+                    EXPECT_LT(distance, lastDistance + 1e-4f) << "eye " << eye.x << " face " << i;
+                    lastDistance = distance;
+                }
+            }
+        }
+
+        vector<uint32_t> reversed;
+        tree.traverse(eye, FRONT_TO_BACK, &reversed);
+        EXPECT_TRUE(equal(order.rbegin(), order.rend(), reversed.begin(), reversed.end()));
+    }
+}
+
+// Layers in the planes y = -2, 0 and 2, a wall in the plane x = 1.2 that splits some of their quads, and a cube between two layers
+TEST(CoplanarTest, OrdersLayersFromEitherSide)
+{
+    const mat4x4 wallTransform(vec4(0.0f, -1.0f, 0.0f, 0.0f), vec4(1.0f, 0.0f, 0.0f, 0.0f), vec4(0.0f, 0.0f, 1.0f, 0.0f), vec4(1.2f, 0.0f, 0.0f, 1.0f)); // Faces +x
+    vector<Face> wall = getQuad(6.0f, 6.0f);
+    for (int leafSize : {0, 64})
+    {
+        BSPTree tree(&materials, BALANCED);
+        tree.setRobustSplitting(true);
+        tree.setLeafSize(leafSize);
+        tree.insertFaces(wall, wallTransform, translucent);
+        tree.insertFaces(getCube(vec3(-1.5f, 1.0f, -1.5f)), mat4x4(1.0f), translucent); // Between two layers
+        float area = 42.0f;
+        for (float y : {-2.0f, 0.0f})
+        {
+            tree.insertFaces(getLayers(y), mat4x4(1.0f), translucent);
+            area += 16.0f;
+        }
+        tree.build();
+        expectPaintersOrder(tree, area);
+
+        tree.insertFaces(getLayers(2.0f), mat4x4(1.0f), translucent); // Pushed down the built tree
+        expectPaintersOrder(tree, area + 16.0f);
+    }
+}
+
+// ==================== Opaque pass ====================
+// Opaque faces leave the tree, and the translucent ones are ordered as if the opaque ones had never been inserted
+TEST(OpaquePassTest, KeepsOnlyTranslucentFacesInTheTreeOrder)
+{
+    vector<Face> glass = getRandomTriangles(512, 10.0f, 1.5f);
+    vector<Face> tinted = getRandomTriangles(256, 10.0f, 1.5f);
+    vector<Face> walls = getRandomTriangles(512, 10.0f, 1.5f);
+
+    BSPTree expected(&materials, BALANCED);
+    expected.insertFaces(glass, mat4x4(1.0f), translucent);
+    expected.insertFaces(tinted, mat4x4(1.0f), nearlyOpaque);
+    expected.build();
+
+    BSPTree tree(&materials, BALANCED);
+    tree.setOpaquePass(true);
+    tree.insertFaces(glass, mat4x4(1.0f), translucent);
+    tree.insertFaces(tinted, mat4x4(1.0f), nearlyOpaque); // Any alpha below 1 blends
+    tree.insertFaces(walls, mat4x4(1.0f), opaque);
+    tree.build();
+
+    for (size_t e = 0; e < size(EYES); ++e)
+    {
+        vector<vec3> corners = getOrderedCorners(tree, EYES[e]);
+        vector<vec3> expectedCorners = getOrderedCorners(expected, EYES[e]);
+        ASSERT_EQ(corners.size(), expectedCorners.size()) << "eye " << e;
+        EXPECT_TRUE(corners == expectedCorners) << "eye " << e;
+    }
+
+    // Faces inserted into the built tree are separated the same way
+    vector<uint32_t> before;
+    tree.traverse(EYES[0], BACK_TO_FRONT, &before);
+    tree.insertFaces(getSphere(0.5f, 8), mat4x4(1.0f), opaque);
+    vector<uint32_t> after;
+    tree.traverse(EYES[0], BACK_TO_FRONT, &after);
+    EXPECT_EQ(after.size(), before.size());
+}
+
+// ==================== Inserting and removing ====================
+TEST(InsertTest, RebuildsKeepTheFaceStoreBounded)
+{
+    vector<Face> triangles = getRandomTriangles(1024, 10.0f, 1.5f);
+    vector<Face> sphere = getSphere(0.5f, 8);
+    BSPTree tree(&materials, BALANCED);
+    tree.insertFaces(triangles, mat4x4(1.0f), translucent);
+    tree.build();
+    BuildStats first = tree.getBuildStats();
+
+    for (int i = 0; i < 5; ++i)
+    {
+        uint32_t object = tree.insertFaces(sphere, mat4x4(1.0f), translucent); // Pushed down and split by the built tree
+        tree.build();
+        tree.removeObject(object);
+        tree.build();
+        EXPECT_EQ(tree.getBuildStats().inputFaces, first.inputFaces);
+        EXPECT_EQ(tree.getBuildStats().fragments, first.fragments); // The same tree again
+        EXPECT_EQ(tree.getBuildStats().bytes, first.bytes); // Including the face store
+    }
+}
+
+// Every saved node hangs off the root and every saved face belongs to a node, so nothing dead is written
+static void expectNoDeadNodes(const BSPTree &tree)
+{
+    string path = testing::TempDir() + "dead.bsptree";
+    ASSERT_TRUE(tree.save(path));
+    ifstream file(path, ios::binary);
+    TreeFileHeader header;
+    file.read((char *) &header, sizeof(header));
+    vector<Node> nodes(header.nodeCount);
+    file.seekg((sizeof(TreeFileHeader) + 63) & ~(size_t) 63);
+    file.read((char *) nodes.data(), nodes.size() * sizeof(Node));
+    file.close();
+    remove(path.c_str());
+
+    vector<int> parents(nodes.size(), 0);
+    uint32_t spanned = 0;
+    for (const Node &node : nodes)
+    {
+        spanned += node.faceCount;
+        for (uint32_t child : {node.back, node.front})
+        {
+            if (child != NULL_INDEX)
+            {
+                ++parents[child];
+            }
+        }
+    }
+    for (uint32_t i = 0; i < nodes.size(); ++i)
+    {
+        EXPECT_EQ(parents[i], i == header.root ? 0 : 1) << "node " << i;
+    }
+    EXPECT_EQ(spanned, header.nodeFaceCount);
+
+    vector<uint32_t> order;
+    tree.traverse(EYES[1], BACK_TO_FRONT, &order);
+    EXPECT_EQ(order.size(), header.nodeFaceCount);
+}
+
+TEST(InsertTest, LeavesNoDeadNodesBehind)
+{
+    BSPTree tree(&materials, BALANCED);
+    tree.setLeafSize(64); // So that the sphere is pushed into leaves, which are built again
+    tree.insertFaces(getRandomTriangles(1024, 10.0f, 1.5f), mat4x4(1.0f), translucent);
+    tree.build();
+    expectNoDeadNodes(tree);
+
+    uint32_t object = tree.insertFaces(getSphere(0.5f, 8), mat4x4(1.0f), translucent);
+    expectNoDeadNodes(tree);
+    tree.removeObject(object);
+    expectNoDeadNodes(tree);
+}
+
+// ==================== Dynamic objects ====================
+// Traversals between draws see the objects placed in the current nodes
+TEST(DynamicObjectTest, TraversesAfterTheTreeChangesWithoutADraw)
+{
+    vector<Face> sphere = getSphere(0.5f, 8);
+    BSPTree object(&materials);
+    object.insertFaces(sphere, mat4x4(1.0f), translucent);
+    object.build();
+
+    BSPTree tree(&materials, BALANCED);
+    tree.insertFaces(getRandomTriangles(256, 10.0f, 1.5f), mat4x4(1.0f), translucent);
+    tree.build();
+    tree.addDynamicObject(&object, mat4x4(1.0f));
+
+    vector<uint32_t> order;
+    auto countObjects = [&]()
+    {
+        tree.traverse(EYES[1], BACK_TO_FRONT, &order);
+        return count_if(order.begin(), order.end(), [](uint32_t entry) { return (entry & DYNAMIC_OBJECT_FLAG) != 0; });
+    };
+    EXPECT_EQ(countObjects(), 1);
+
+    size_t expected = order.size() + sphere.size();
+    uint32_t inserted = tree.insertFaces(sphere, mat4x4(1.0f), translucent); // Adds nodes below the built ones
+    EXPECT_EQ(countObjects(), 1);
+    EXPECT_GE(order.size(), expected);
+
+    tree.removeObject(inserted);
+    EXPECT_EQ(countObjects(), 1);
+    tree.build();
+    EXPECT_EQ(countObjects(), 1);
+    tree.removeDynamicObject(0);
+    EXPECT_EQ(countObjects(), 0);
+}
+
+// ==================== Saving and loading ====================
+class TreeFileTest : public testing::Test
+{
+    protected:
+        string path = testing::TempDir() + "test.bsptree";
+        vector<Face> triangles = getRandomTriangles(512, 10.0f, 1.5f);
+
+        void SetUp() override
+        {
+            BSPTree tree(&materials, BALANCED);
+            tree.insertFaces(triangles, mat4x4(1.0f), translucent);
+            tree.build();
+            ASSERT_TRUE(tree.save(path));
+        }
+
+        void TearDown() override
+        {
+            remove(path.c_str());
+        }
+
+        // Overwrites the 32-bit value at offset, keeping the size of the file
+        void corrupt(size_t offset, uint32_t value)
+        {
+            fstream file(path, ios::in | ios::out | ios::binary);
+            file.seekp(offset);
+            file.write((const char *) &value, sizeof(value));
+        }
+
+        bool load()
+        {
+            BSPTree tree(&materials, BALANCED);
+            tree.insertFaces(triangles, mat4x4(1.0f), translucent);
+            return tree.load(path);
+        }
+};
+
+TEST_F(TreeFileTest, LoadsAnIntactFile)
+{
+    EXPECT_TRUE(load());
+}
+
+TEST_F(TreeFileTest, RefusesAChildIndexOutOfRange)
+{
+    size_t nodes = (sizeof(TreeFileHeader) + 63) & ~(size_t) 63;
+    corrupt(nodes + offsetof(Node, front), 0x7FFFFFFF);
+    EXPECT_FALSE(load());
+}
+
+TEST_F(TreeFileTest, RefusesAFaceSpanOutOfRange)
+{
+    size_t nodes = (sizeof(TreeFileHeader) + 63) & ~(size_t) 63;
+    corrupt(nodes + offsetof(Node, faceCount), 0xFFFFFFF0);
+    EXPECT_FALSE(load());
+}
+
+// ==================== Loading meshes ====================
+class MeshFileTest : public testing::Test
+{
+    protected:
+        string path = testing::TempDir() + "test.obj";
+
+        void TearDown() override
+        {
+            remove(path.c_str());
+            remove(getMeshCachePath(path).c_str());
+        }
+
+        void write(const string &text)
+        {
+            ofstream file(path, ios::binary | ios::trunc);
+            file << text;
+        }
+
+        void setTime(time_t seconds)
+        {
+            timespec times[2] = {{seconds, 0}, {seconds, 0}};
+            utimensat(AT_FDCWD, path.c_str(), times, 0);
+        }
+};
+
+TEST_F(MeshFileTest, ZeroesTheComponentsOfMalformedVectors)
+{
+    write("v 1 2 3\nv 4 x 6\nv 7\nvn 0 1\nvn 0 0 1\nf 1//2 2//2 3//1\n");
+    Mesh mesh = parseMesh(path);
+
+    ASSERT_EQ(mesh.positions.size(), 3u);
+    EXPECT_EQ(mesh.positions[0], vec3(1.0f, 2.0f, 3.0f));
+    EXPECT_EQ(mesh.positions[1], vec3(4.0f, 0.0f, 0.0f));
+    EXPECT_EQ(mesh.positions[2], vec3(7.0f, 0.0f, 0.0f));
+    ASSERT_EQ(mesh.normals.size(), 2u);
+    EXPECT_EQ(mesh.normals[0], vec3(0.0f, 1.0f, 0.0f));
+    EXPECT_EQ(mesh.normals[1], vec3(0.0f, 0.0f, 1.0f));
+    EXPECT_EQ(mesh.corners.size(), 3u);
+}
+
+TEST_F(MeshFileTest, RebuildsTheCacheWhenTheSourceChanges)
+{
+    write("v 0 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 3\n");
+    setTime(1000000000);
+    EXPECT_EQ(loadMesh(path).positions[1], vec3(1.0f, 0.0f, 0.0f));
+    Mesh cached;
+    EXPECT_TRUE(readMeshCache(path, &cached));
+
+    // Same size, later modification time
+    write("v 0 0 0\nv 2 0 0\nv 0 1 0\nf 1 2 3\n");
+    setTime(1000000001);
+    EXPECT_FALSE(readMeshCache(path, &cached));
+    EXPECT_EQ(loadMesh(path).positions[1], vec3(2.0f, 0.0f, 0.0f));
+
+    // Same modification time, another size
+    write("v 0 0 0\nv 3 0 0\nv 0 1 0\nv 0 0 1\nf 1 2 3\n");
+    setTime(1000000001);
+    EXPECT_FALSE(readMeshCache(path, &cached));
+    Mesh mesh = loadMesh(path);
+    EXPECT_EQ(mesh.positions.size(), 4u);
+    EXPECT_EQ(mesh.positions[1], vec3(3.0f, 0.0f, 0.0f));
+    EXPECT_TRUE(readMeshCache(path, &cached));
+}
+
+TEST_F(MeshFileTest, ParsingLeavesTheCacheAlone)
+{
+    write("v 0 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 3\n");
+    EXPECT_EQ(parseData(path).size(), 1u);
+    EXPECT_FALSE(ifstream(getMeshCachePath(path)).is_open());
+}
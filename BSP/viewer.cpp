@@ -8,6 +8,7 @@
 #include <cmath>
 #include "objImporter.h"
 #include "BSPTree.h"
+#include "Shapes.h"
 using namespace std;
 using namespace glm;
 
@@ -31,8 +32,6 @@ void insertGoldenSphere();
 void insertSilverSphere();
 void insertSapphireSphere();
 void insertTrackPoint();
-vector<Face> getSphere(float radius, int segment);
-vector<Face> getQuad(float x, float y);
 
 void mouseClick(int button, int state, int x, int y);
 GLboolean select(GLint x, GLint y);
@@ -50,7 +49,7 @@ void drawObj(const vector<Face> &mesh);
 mat4x4 getCurrentTranform();
 
 // ==================== Global variables ====================
-static GLfloat ratio = 0.0;
+static GLfloat aspectRatio = 0.0;
 static GLfloat windowW = 1000.0;
 static GLfloat windowH = 1000.0;
 static GLfloat nearClip = 1.0;
@@ -106,18 +105,21 @@ static vector<GLdouble> rotationCenter = {0.0, 0.0, initDollyAmount};
 
 static GLfloat showAllDolly = -350.0;
 
+static const char *treeFilePath = "./scene.bsptree";
+
 // ==================== Object variables ====================
-vector<Face> led;
-vector<Face> thinkPad;
-vector<Face> panel;
-vector<Face> plane;
+Mesh led;
+Mesh thinkPad;
+Mesh panel;
+Mesh plane;
 vector<Face> background;
 vector<Face> sphere;
-vector<Face> key;
-vector<Face> trackPoint;
-vector<Face> cube;
+Mesh key;
+Mesh trackPoint;
+Mesh cube;
 
-BSPTree bt;
+MaterialTable materials;
+BSPTree bt(&materials, BALANCED);
 
 int main(int argc, char** argv)
 {
@@ -154,15 +156,15 @@ void init()
     glEnable(GL_BLEND);
 
     // ==================== Test2 ====================
-    led = parseData("./Models/LED.obj");
-    thinkPad = parseData("./Models/ThinkPad.obj");
-    panel = parseData("./Models/Panel.obj");
-	plane = parseData("./Models/Plane.obj");
+    led = loadMesh("./Models/LED.obj");
+    thinkPad = loadMesh("./Models/ThinkPad.obj");
+    panel = loadMesh("./Models/Panel.obj");
+	plane = loadMesh("./Models/Plane.obj");
 	background = getQuad(10, 10);
     sphere = getSphere(0.5f, 8);
-    key = parseData("./Models/Key.obj");
-    trackPoint = parseData("./Models/TrackPoint.obj");
-    cube = parseData("./Models/Cube.obj");
+    key = loadMesh("./Models/Key.obj");
+    trackPoint = loadMesh("./Models/TrackPoint.obj");
+    cube = loadMesh("./Models/Cube.obj");
 
     // ==================== Build a BSP tree ====================
     glPushMatrix();
@@ -217,7 +219,19 @@ void init()
 		insertTrackPoint();
     glPopMatrix();
 
-    bt.build();
+    bt.setRobustSplitting(true); // Split at scale-relative tolerances without slivers
+    bt.setLeafSize(256); // Convex groups such as most of the LED are kept whole in a leaf
+    bt.setOpaquePass(true); // Only the translucent faces need the order of the tree; the rest use the depth buffer
+    if (!bt.load(treeFilePath)) // Only rebuild when the scene changed since the tree was saved
+    {
+        bt.setBuildThreads(0); // Build subtrees on every core
+        bt.build();
+        bt.save(treeFilePath);
+
+        const BuildStats &stats = bt.getBuildStats();
+        cout << "Built " << stats.nodeCount << " nodes from " << stats.inputFaces << " faces (" << stats.fragments << " fragments, depth " << stats.maxDepth
+            << ") in " << stats.prepareMs + stats.partitionMs + stats.finishMs << " ms" << endl;
+    }
 
     // ==================== Initialize the view ====================
     glLoadIdentity();
@@ -233,7 +247,7 @@ void display()
     // Zoom - separated since it affects picking
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
-    gluPerspective(fov + fovOffset, ratio, nearClip, farClip);
+    gluPerspective(fov + fovOffset, aspectRatio, nearClip, farClip);
 
     drawScene(GL_MODELVIEW);
     glutSwapBuffers();
@@ -267,6 +281,7 @@ void drawScene(GLenum mode)
     glMultMatrixf(currShiftRotationMat);
 
     // ==================== Draw by traversing the BSP tree ====================
+    materials.beginFrame();
     GLfloat *transformArr = new GLfloat[16];
     glGetFloatv(GL_MODELVIEW_MATRIX, transformArr);
     mat4x4 transformMat = make_mat4x4(transformArr);
@@ -369,7 +384,7 @@ GLboolean select(GLint x, GLint y) // Mouse position x, y
 		glRenderMode(GL_SELECT);
 		glLoadIdentity();
 		gluPickMatrix(x, viewport[3] - y, 0.1, 0.1, viewport);
-		gluPerspective(fov, ratio, nearClip, farClip);
+		gluPerspective(fov, aspectRatio, nearClip, farClip);
 
 		glMatrixMode(GL_MODELVIEW);
 		glLoadIdentity();
@@ -484,10 +499,10 @@ void reshape(int w, int h)
 	glViewport(0, 0, (GLsizei) w, (GLsizei) h);
 	glMatrixMode(GL_PROJECTION);
 	glLoadIdentity();
-	ratio = (GLfloat) w / (GLfloat) h;
+	aspectRatio = (GLfloat) w / (GLfloat) h;
 	windowW = w;
 	windowH = h;
-	gluPerspective(fov, ratio, nearClip, farClip);
+	gluPerspective(fov, aspectRatio, nearClip, farClip);
 	glMatrixMode(GL_MODELVIEW);
 }
 
@@ -556,189 +571,65 @@ mat4x4 getCurrentTranform()
 // ==================== Functions that set the material property of each object and draw it ====================
 void insertLED()
 {
-    GLfloat *diffuse = new GLfloat[4]{1, 0, 0, 0.8};
-    GLfloat *specular = new GLfloat[4]{0.79,0.33,0.33, 0.8};
-    GLfloat *shininess = new GLfloat[1]{100};
-    GLfloat *emission = new GLfloat[4]{1, 0, 0, 1};
+    Material material = {{1, 0, 0, 0.8}, {0.79,0.33,0.33, 0.8}, {100}, {1, 0, 0, 1}};
 
-    bt.insertFaces(led, getCurrentTranform(), diffuse, specular, shininess, emission);
+    bt.insertMesh(led, getCurrentTranform(), materials.add(material));
 }
 
 void insertThinkPad()
 {
-	GLfloat *diffuse = new GLfloat[4]{1, 1, 1, 1}; // Diffuse color
-	GLfloat *specular = new GLfloat[4]{1, 1, 1, 1}; // Amount of specular reflection of each component
-	GLfloat *shininess = new GLfloat[1]{3}; // Specular range; higher value results a narrower specular reflection range
-	GLfloat *emission = new GLfloat[4]{0, 0, 0, 1}; // Emiting color
+	Material material = {{1, 1, 1, 1}, {1, 1, 1, 1}, {3}, {0, 0, 0, 1}};
 
-	bt.insertFaces(thinkPad, getCurrentTranform(), diffuse, specular, shininess, emission);
+	bt.insertMesh(thinkPad, getCurrentTranform(), materials.add(material));
 }
 
 void insertPanel()
 {
-    GLfloat *diffuse = new GLfloat[4]{0.8, 1, 1, 0.25};
-    GLfloat *specular = new GLfloat[4]{1, 1, 1, 1};
-    GLfloat *shininess = new GLfloat[1]{100};
-    GLfloat *emission = new GLfloat[4]{0, 0, 0, 1};
+    Material material = {{0.8, 1, 1, 0.25}, {1, 1, 1, 1}, {100}, {0, 0, 0, 1}};
 
-    bt.insertFaces(panel, getCurrentTranform(), diffuse, specular, shininess, emission);
+    bt.insertMesh(panel, getCurrentTranform(), materials.add(material));
 }
 
 void insertPlane()
 {
-    GLfloat *diffuse = new GLfloat[4]{0.1, 0.1, 0.1, 1};
-    GLfloat *specular = new GLfloat[4]{0.1, 0.1, 0.1, 1};
-    GLfloat *shininess = new GLfloat[1]{3};
-    GLfloat *emission = new GLfloat[4]{0, 0, 0, 1};
+    Material material = {{0.1, 0.1, 0.1, 1}, {0.1, 0.1, 0.1, 1}, {3}, {0, 0, 0, 1}};
 
-    bt.insertFaces(plane, getCurrentTranform(), diffuse, specular, shininess, emission);
+    bt.insertMesh(plane, getCurrentTranform(), materials.add(material));
 }
 
 void insertBackground()
 {
-	GLfloat *diffuse = new GLfloat[4]{0.1, 0.1, 0.1, 1};
-    GLfloat *specular = new GLfloat[4]{0.1, 0.1, 0.1, 1};
-    GLfloat *shininess = new GLfloat[1]{3};
-    GLfloat *emission = new GLfloat[4]{0, 0, 0, 1};
+	Material material = {{0.1, 0.1, 0.1, 1}, {0.1, 0.1, 0.1, 1}, {3}, {0, 0, 0, 1}};
 
-    bt.insertFaces(background, getCurrentTranform(), diffuse, specular, shininess, emission);
+    bt.insertFaces(background, getCurrentTranform(), materials.add(material));
 }
 
 void insertGoldenSphere()
 {
-	GLfloat *diffuse = new GLfloat[4]{0.88, 0.75, 0.3, 1};
-	GLfloat *specular = new GLfloat[4]{1, 0.84, 0, 1};
-	GLfloat *shininess = new GLfloat[1]{10};
-	GLfloat *emission = new GLfloat[4]{0, 0, 0, 1};
+	Material material = {{0.88, 0.75, 0.3, 1}, {1, 0.84, 0, 1}, {10}, {0, 0, 0, 1}};
 
-	bt.insertFaces(sphere, getCurrentTranform(), diffuse, specular, shininess, emission);
+	bt.insertFaces(sphere, getCurrentTranform(), materials.add(material));
 }
 
 void insertSilverSphere()
 {
-	GLfloat *diffuse = new GLfloat[4]{0.7, 0.7, 0.7, 1};
-	GLfloat *specular = new GLfloat[4]{1, 1, 1, 1};
-	GLfloat *shininess = new GLfloat[1]{128};
-	GLfloat *emission = new GLfloat[4]{0, 0, 0, 1};
+	Material material = {{0.7, 0.7, 0.7, 1}, {1, 1, 1, 1}, {128}, {0, 0, 0, 1}};
 
-	bt.insertFaces(sphere, getCurrentTranform(), diffuse, specular, shininess, emission);
+	bt.insertFaces(sphere, getCurrentTranform(), materials.add(material));
 }
 
 void insertSapphireSphere()
 {
-	GLfloat *diffuse = new GLfloat[4]{0.37, 0.45, 1, 0.5};
-	GLfloat *specular = new GLfloat[4]{0.87, 0.86, 1, 1};
-	GLfloat *shininess = new GLfloat[1]{128};
-	GLfloat *emission = new GLfloat[4]{0, 0, 0, 1};
+	Material material = {{0.37, 0.45, 1, 0.5}, {0.87, 0.86, 1, 1}, {128}, {0, 0, 0, 1}};
 
-	bt.insertFaces(sphere, getCurrentTranform(), diffuse, specular, shininess, emission);
+	bt.insertFaces(sphere, getCurrentTranform(), materials.add(material));
 }
 
 void insertTrackPoint()
 {
-	GLfloat *diffuse = new GLfloat[4]{1, 0.09, 0.11, 1};
-	GLfloat *specular = new GLfloat[4]{1, 0.59, 0.6, 1};
-	GLfloat *shininess = new GLfloat[1]{5};
-	GLfloat *emission = new GLfloat[4]{0, 0, 0, 1};
+	Material material = {{1, 0.09, 0.11, 1}, {1, 0.59, 0.6, 1}, {5}, {0, 0, 0, 1}};
     
-	bt.insertFaces(trackPoint, getCurrentTranform(), diffuse, specular, shininess, emission);
-}
-
-vector<Face> getSphere(float radius, int segment) // The center is located at (0, 0, 0)
-{
-	vector<Face> faces;
-	for (float phi = 0.0f; phi < M_PI; phi += M_PI / segment)
-	{
-		for (float theta = 0.0f; theta < (2.0f + 1e-2f) * M_PI; theta += M_PI / segment)
-		{
-			float x;
-			float y;
-			float z;
-
-			// Face 1
-			Face f1;
-			
-			x = radius * cos(theta) * sin(phi);
-			y = radius * sin(theta) * sin(phi);
-			z = radius * cos(phi);
-			f1.v1 = vec3(x, y, z);
-			f1.n1 = normalize(vec3(x, y, z));
-
-			x = radius * cos(theta + M_PI / segment) * sin(phi);
-			y = radius * sin(theta + M_PI / segment) * sin(phi);
-			z = radius * cos(phi);
-			f1.v2 = vec3(x, y, z);
-			f1.n2 = normalize(vec3(x, y, z));
-			
-			x = radius * cos(theta) * sin(phi + M_PI / segment);
-			y = radius * sin(theta) * sin(phi + M_PI / segment);
-			z = radius * cos(phi + M_PI / segment);
-			f1.v3 = vec3(x, y, z);
-			f1.n3 = normalize(vec3(x, y, z));
-
-			faces.push_back(f1);
-
-			// Face2
-			Face f2;
-			
-			x = radius * cos(theta) * sin(phi + M_PI / segment);
-			y = radius * sin(theta) * sin(phi + M_PI / segment);
-			z = radius * cos(phi + M_PI / segment);
-			f2.v1 = vec3(x, y, z);
-			f2.n1 = normalize(vec3(x, y, z));
-
-			x = radius * cos(theta + M_PI / segment) * sin(phi);
-			y = radius * sin(theta + M_PI / segment) * sin(phi);
-			z = radius * cos(phi);
-			f2.v2 = vec3(x, y, z);
-			f2.n2 = normalize(vec3(x, y, z));
-
-			x = radius * cos(theta + M_PI / segment) * sin(phi + M_PI / segment);
-			y = radius * sin(theta + M_PI / segment) * sin(phi + M_PI / segment);
-			z = radius * cos(phi + M_PI / segment);
-			f2.v3 = vec3(x, y, z);
-			f2.n3 = normalize(vec3(x, y, z));
-
-			faces.push_back(f2);
-		}
-	}
-
-	return faces;
-}
-
-vector<Face> getQuad(float x, float z)
-{
-	float halfX = x / 2.0f;
-	float halfZ = z / 2.0f;
-	vector<Face> faces;
-
-	// Make f1
-	Face f1;
-	f1.v1 = vec3(-halfX, 0, halfZ);
-	f1.n1 = vec3(0, 1, 0);
-
-	f1.v2 = vec3(halfX, 0, -halfZ);
-	f1.n2 = vec3(0, 1, 0);
-
-	f1.v3 = vec3(-halfX, 0, -halfZ);
-	f1.n3 = vec3(0, 1, 0);
-
-	faces.push_back(f1);
-
-	// Make f2
-	Face f2;
-	f2.v1 = vec3(halfX, 0, halfZ);
-	f2.n1 = vec3(0, 1, 0);
-
-	f2.v2 = vec3(halfX, 0, -halfZ);
-	f2.n2 = vec3(0, 1, 0);
-
-	f2.v3 = vec3(-halfX, 0, halfZ);
-	f2.n3 = vec3(0, 1, 0);
-
-	faces.push_back(f2);
-
-	return faces;
+	bt.insertMesh(trackPoint, getCurrentTranform(), materials.add(material));
 }
 
 // ==================== Functions that set the light properties ====================